@@ -1,3 +1,3 @@
-RayTracing.exe -MIS MultiLight_MIS.ppm
-RayTracing.exe -LIGHT MultiLight_LIGHT.ppm
-RayTracing.exe -BRDF MultiLight_BRDF.ppm
+RayTracing.exe -MIS --headless MultiLight_MIS.ppm
+RayTracing.exe -LIGHT --headless MultiLight_LIGHT.ppm
+RayTracing.exe -BRDF --headless MultiLight_BRDF.ppm
@@ -1,3 +1,3 @@
-RayTracing -MIS MultiLight_MIS.ppm
-RayTracing -LIGHT MultiLight_LIGHT.ppm
-RayTracing -BRDF MultiLight_BRDF.ppm
+RayTracing -MIS --headless MultiLight_MIS.ppm
+RayTracing -LIGHT --headless MultiLight_LIGHT.ppm
+RayTracing -BRDF --headless MultiLight_BRDF.ppm
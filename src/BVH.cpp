@@ -1,123 +1,868 @@
 #include "BVH.hpp"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <future>
 #include <mutex>
+#include <thread>
+#include <unordered_set>
 
+#include "LBVH.hpp"
 #include "Profiler.h"
 
+struct SBVHBuildState {
+    const BVHAccel::ClipFn &clip;
+    int duplicatesLeft;
+    float rootArea;
+    // references in leaf order
+    std::vector<BVHPrimitiveInfo> ordered;
+};
+
 BVHAccel::BVHAccel(std::vector<Object *> p, int maxPrimsInNode,
-                   SplitMethod splitMethod)
+                   SplitMethod splitMethod, NodeLayout layout,
+                   float duplicateBudget)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
+      layout(layout), duplicateBudget(duplicateBudget),
       primitives(std::move(p)) {
-    if (primitives.empty())
-        return;
-    RAIIProfiler profiler;
-    root = recursiveBuild(primitives);
+    orderPrimitives();
 }
 
 BVHAccel::BVHAccel(const std::vector<std::unique_ptr<Object>> &p,
-                   int maxPrimsInNode, SplitMethod splitMethod)
-    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod) {
+                   int maxPrimsInNode, SplitMethod splitMethod,
+                   NodeLayout layout, float duplicateBudget)
+    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
+      layout(layout), duplicateBudget(duplicateBudget) {
     for (auto &&obj : p) {
         primitives.push_back(obj.get());
     }
+    orderPrimitives();
+}
+
+BVHAccel::BVHAccel(const std::vector<Bounds3> &primitiveBounds,
+                   int maxPrimsInNode, SplitMethod splitMethod,
+                   NodeLayout layout, const ClipFn &clip,
+                   float duplicateBudget)
+    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
+      layout(layout), duplicateBudget(duplicateBudget) {
+    build(primitiveBounds, clip);
+}
+
+BVHAccel::BVHAccel(std::vector<LinearBVHNode> flatNodes, int maxPrimsInNode,
+                   SplitMethod splitMethod, NodeLayout layout)
+    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
+      layout(layout), nodes(std::move(flatNodes)) {
+    measureDepth();
+    buildWideNodes();
+    recordBuildAreas();
+    if (layout == NodeLayout::COMPRESSED)
+        releaseBinaryTree();
+}
+
+void BVHAccel::orderPrimitives() {
     if (primitives.empty())
         return;
-    RAIIProfiler profiler;
-    root = recursiveBuild(primitives);
+    std::vector<Bounds3> primitiveBounds(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        primitiveBounds[i] = primitives[i]->getBounds();
+    build(primitiveBounds, [this](uint32_t i, const Bounds3 &box) {
+        return primitives[i]->clipBounds(box);
+    });
+
+    std::vector<Object *> orderedPrims(primitiveOrder.size());
+    for (size_t i = 0; i < primitiveOrder.size(); ++i)
+        orderedPrims[i] = primitives[primitiveOrder[i]];
+    primitives.swap(orderedPrims);
+    primitiveOrder = std::vector<uint32_t>();
+    buildAreaCdf();
+}
+
+void BVHAccel::buildAreaCdf() {
+    // Only spatial splits repeat primitives, skip the lookup otherwise.
+    std::unordered_set<const Object *> seen;
+    areaCdf.resize(primitives.size());
+    float area = 0;
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        if (splitMethod != SplitMethod::SBVH ||
+            seen.insert(primitives[i]).second)
+            area += primitives[i]->getArea();
+        areaCdf[i] = area;
+    }
+}
+
+void BVHAccel::build(const std::vector<Bounds3> &primitiveBounds,
+                     const ClipFn &clip) {
+    if (primitiveBounds.empty())
+        return;
+    RAIIProfiler profiler("BVH build");
+
+    // Bounds and centroids are computed once up front, the builder never
+    // touches the primitives again.
+    std::vector<BVHPrimitiveInfo> primitiveInfo(primitiveBounds.size());
+    for (size_t i = 0; i < primitiveBounds.size(); ++i)
+        primitiveInfo[i] = {i, primitiveBounds[i]};
+
+    std::unique_ptr<BVHBuildNode> root;
+    if (splitMethod == SplitMethod::SBVH) {
+        Bounds3 rootBounds;
+        for (const auto &info : primitiveInfo)
+            rootBounds = Union(rootBounds, info.bounds);
+        SBVHBuildState state{
+            clip, (int)(duplicateBudget * primitiveInfo.size()),
+            (float)rootBounds.SurfaceArea(), {}};
+        state.ordered.reserve(primitiveInfo.size() + state.duplicatesLeft);
+        root = recursiveBuildSBVH(std::move(primitiveInfo), 0, state);
+        primitiveInfo = std::move(state.ordered);
+    } else if (isLinear()) {
+        BuildLBVH(primitiveInfo, maxPrimsInNode,
+                  splitMethod == SplitMethod::TRBVH, nodes);
+    } else {
+        root = recursiveBuild(primitiveInfo, 0, (int)primitiveInfo.size(), 0);
+    }
+
+    // Leaves reference ranges of primitiveInfo, which has been partitioned
+    // in place; record which primitive ended up where.
+    primitiveOrder.resize(primitiveInfo.size());
+    for (size_t i = 0; i < primitiveInfo.size(); ++i)
+        primitiveOrder[i] = (uint32_t)primitiveInfo[i].primitiveNumber;
+
+    // Pack the tree into a depth-first array; the pointer tree is only a
+    // build time structure and is released on return.
+    if (root) {
+        nodes.reserve(2 * primitiveInfo.size() - 1);
+        int offset = 0;
+        flattenBVHTree(root.get(), nodes, &offset);
+    }
+    measureDepth();
+    buildWideNodes();
+    recordBuildAreas();
+    if (layout == NodeLayout::COMPRESSED)
+        releaseBinaryTree();
+}
+
+void BVHAccel::measureDepth() {
+    // Children are stored after their parent, so a forward sweep knows the
+    // depth of a node before it reaches its children.
+    std::vector<int> depth(nodes.size(), 0);
+    maxDepth = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        maxDepth = std::max(maxDepth, depth[i]);
+        if (nodes[i].nPrimitives == 0) {
+            depth[i + 1] = depth[i] + 1;
+            depth[nodes[i].secondChildOffset] = depth[i] + 1;
+        }
+    }
+}
+
+void BVHAccel::buildWideNodes() {
+    if (layout == NodeLayout::BINARY || nodes.empty())
+        return;
+    width = WidestBVHWidth();
+    if (width == 8)
+        CollapseBVH(nodes, wideNodes8);
+    else
+        CollapseBVH(nodes, wideNodes4);
+    if (layout == NodeLayout::COMPRESSED) {
+        CompressBVH(wideNodes8, compressedNodes8);
+        CompressBVH(wideNodes4, compressedNodes4);
+        wideNodes8 = std::vector<WideBVHNode<8>>();
+        wideNodes4 = std::vector<WideBVHNode<4>>();
+    }
+}
+
+void BVHAccel::releaseBinaryTree() {
+    if (!nodes.empty())
+        rootBounds = nodes[0].bounds;
+    nodes = std::vector<LinearBVHNode>();
+    buildAreas = std::vector<float>();
+}
+
+void BVHAccel::setLayout(NodeLayout newLayout) {
+    assert(layout != NodeLayout::COMPRESSED || newLayout == layout);
+    if (newLayout == layout)
+        return;
+    layout = newLayout;
+    width = 2;
+    wideNodes4 = std::vector<WideBVHNode<4>>();
+    wideNodes8 = std::vector<WideBVHNode<8>>();
+    buildWideNodes();
+    if (layout == NodeLayout::COMPRESSED)
+        releaseBinaryTree();
+}
+
+void BVHAccel::recordBuildAreas() {
+    buildAreas.resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i)
+        buildAreas[i] = nodes[i].bounds.SurfaceArea();
+}
+
+bool BVHAccel::refit(float rebuildThreshold) {
+    if (primitives.empty())
+        return false;
+    if (layout == NodeLayout::COMPRESSED) {
+        // Nothing is left to refit, build anew over each primitive once;
+        // spatial splits may have repeated some.
+        std::unordered_set<const Object *> seen;
+        primitives.erase(std::remove_if(primitives.begin(), primitives.end(),
+                                        [&](const Object *primitive) {
+                                            return !seen.insert(primitive)
+                                                        .second;
+                                        }),
+                         primitives.end());
+        orderPrimitives();
+        return true;
+    }
+    std::vector<Bounds3> primitiveBounds(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        primitiveBounds[i] = primitives[i]->getBounds();
+    bool reordered = refit(primitiveBounds, rebuildThreshold);
+    if (reordered) {
+        std::vector<Object *> orderedPrims(primitives.size());
+        for (size_t i = 0; i < primitiveOrder.size(); ++i)
+            orderedPrims[i] = primitives[primitiveOrder[i]];
+        primitives.swap(orderedPrims);
+        primitiveOrder = std::vector<uint32_t>();
+    }
+    // areas change with scaling transforms, not only with a new order
+    buildAreaCdf();
+    return reordered;
+}
+
+bool BVHAccel::refit(const std::vector<Bounds3> &primitiveBounds,
+                     float rebuildThreshold) {
+    if (primitiveBounds.empty())
+        return false;
+    if (layout == NodeLayout::COMPRESSED) {
+        // the binary tree was released, so the whole tree is rebuilt
+        build(primitiveBounds, nullptr);
+        return true;
+    }
+    if (nodes.empty())
+        return false;
+    RAIIProfiler profiler("BVH refit");
+
+    // Children are stored after their parent, so a reverse sweep sees both
+    // children of a node before the node itself.
+    for (int i = (int)nodes.size() - 1; i >= 0; --i) {
+        LinearBVHNode &node = nodes[i];
+        if (node.nPrimitives > 0) {
+            Bounds3 bounds;
+            for (int j = 0; j < node.nPrimitives; ++j)
+                bounds =
+                    Union(bounds, primitiveBounds[node.primitivesOffset + j]);
+            node.bounds = bounds;
+        } else {
+            node.bounds = Union(nodes[i + 1].bounds,
+                                nodes[node.secondChildOffset].bounds);
+        }
+    }
+
+    // Refitting keeps the topology, which degrades once primitives move
+    // apart. Rebuild the topmost subtrees whose surface area, and with it
+    // the chance of being visited, grew past the threshold since they were
+    // built.
+    std::vector<int> degraded;
+    std::vector<int> toVisit = {0};
+    while (!toVisit.empty()) {
+        int i = toVisit.back();
+        toVisit.pop_back();
+        if (nodes[i].nPrimitives > 0)
+            continue;
+        if (nodes[i].bounds.SurfaceArea() >
+            rebuildThreshold * buildAreas[i]) {
+            degraded.push_back(i);
+            continue;
+        }
+        toVisit.push_back(i + 1);
+        toVisit.push_back(nodes[i].secondChildOffset);
+    }
+
+    if (!degraded.empty()) {
+        primitiveOrder.resize(primitiveBounds.size());
+        for (size_t i = 0; i < primitiveOrder.size(); ++i)
+            primitiveOrder[i] = (uint32_t)i;
+        // From the back, so splicing one subtree leaves the positions of
+        // the remaining ones intact.
+        std::sort(degraded.begin(), degraded.end());
+        for (auto it = degraded.rbegin(); it != degraded.rend(); ++it)
+            rebuildSubtree(*it, primitiveBounds);
+        measureDepth();
+    }
+    buildWideNodes();
+    return !degraded.empty();
+}
+
+void BVHAccel::rebuildSubtree(int root,
+                              const std::vector<Bounds3> &primitiveBounds) {
+    // A subtree is a contiguous range of nodes, ending after its rightmost
+    // leaf, and its leaves cover a contiguous range of primitives.
+    int last = root, first = root;
+    while (nodes[last].nPrimitives == 0)
+        last = nodes[last].secondChildOffset;
+    while (nodes[first].nPrimitives == 0)
+        ++first;
+    int end = last + 1;
+    int primStart = nodes[first].primitivesOffset;
+    int primEnd = nodes[last].primitivesOffset + nodes[last].nPrimitives;
+
+    std::vector<BVHPrimitiveInfo> primitiveInfo(primEnd - primStart);
+    for (int i = primStart; i < primEnd; ++i)
+        primitiveInfo[i - primStart] = {(size_t)i, primitiveBounds[i]};
+    std::vector<LinearBVHNode> subtree;
+    if (isLinear()) {
+        BuildLBVH(primitiveInfo, maxPrimsInNode,
+                  splitMethod == SplitMethod::TRBVH, subtree);
+    } else {
+        std::unique_ptr<BVHBuildNode> tree =
+            recursiveBuild(primitiveInfo, 0, (int)primitiveInfo.size(), 0);
+        int offset = 0;
+        flattenBVHTree(tree.get(), subtree, &offset);
+    }
+
+    // Rebase the new nodes, then shift every link that points past the old
+    // subtree by the change in node count.
+    for (auto &node : subtree) {
+        if (node.nPrimitives > 0)
+            node.primitivesOffset += primStart;
+        else
+            node.secondChildOffset += root;
+    }
+    int delta = (int)subtree.size() - (end - root);
+    for (int i = 0; i < (int)nodes.size(); ++i) {
+        if ((i < root || i >= end) && nodes[i].nPrimitives == 0 &&
+            nodes[i].secondChildOffset >= end)
+            nodes[i].secondChildOffset += delta;
+    }
+    std::vector<float> subtreeAreas(subtree.size());
+    for (size_t i = 0; i < subtree.size(); ++i)
+        subtreeAreas[i] = subtree[i].bounds.SurfaceArea();
+    nodes.erase(nodes.begin() + root, nodes.begin() + end);
+    nodes.insert(nodes.begin() + root, subtree.begin(), subtree.end());
+    buildAreas.erase(buildAreas.begin() + root, buildAreas.begin() + end);
+    buildAreas.insert(buildAreas.begin() + root, subtreeAreas.begin(),
+                      subtreeAreas.end());
+
+    std::vector<uint32_t> order(primitiveInfo.size());
+    for (size_t i = 0; i < primitiveInfo.size(); ++i)
+        order[i] = primitiveOrder[primitiveInfo[i].primitiveNumber];
+    std::copy(order.begin(), order.end(), primitiveOrder.begin() + primStart);
+}
+
+int BVHAccel::flattenBVHTree(const BVHBuildNode *node,
+                             std::vector<LinearBVHNode> &out, int *offset) {
+    int myOffset = (*offset)++;
+    out.emplace_back();
+    out[myOffset].bounds = node->bounds;
+    if (node->left == nullptr) {
+        out[myOffset].primitivesOffset = node->firstPrimOffset;
+        out[myOffset].nPrimitives = node->nPrimitives;
+    } else {
+        out[myOffset].axis = node->splitAxis;
+        out[myOffset].nPrimitives = 0;
+        flattenBVHTree(node->left.get(), out, offset);
+        out[myOffset].secondChildOffset =
+            flattenBVHTree(node->right.get(), out, offset);
+    }
+    return myOffset;
+}
+
+// Subtrees are handed to another thread while the tree is still shallow
+// enough that the number of concurrent builders stays around the number of
+// hardware threads, and the subtree is big enough to pay for the hand-off.
+static int parallelBuildDepth() {
+    static const int depth = [] {
+        unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+        int d = 0;
+        while ((1u << d) < threads)
+            ++d;
+        return d;
+    }();
+    return depth;
 }
+static constexpr int kParallelBuildThreshold = 4096;
 
 std::unique_ptr<BVHBuildNode>
-BVHAccel::recursiveBuild(std::vector<Object *> objects) {
+BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                         int start, int end, int depth) {
     auto node = std::make_unique<BVHBuildNode>();
 
     // Compute bounds of all primitives in BVH node
     Bounds3 bounds;
-    for (auto &object : objects)
-        bounds = Union(bounds, object->getBounds());
-    if (objects.size() == 1) {
+    for (int i = start; i < end; ++i)
+        bounds = Union(bounds, primitiveInfo[i].bounds);
+    int nPrimitives = end - start;
+    auto makeLeaf = [&]() {
         // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->area = objects[0]->getArea();
-        return node;
-    } else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
-    } else {
-        Bounds3 centroidBounds = Bounds3(objects[0]->getBounds().Centroid());
-        for (auto &object : objects)
-            centroidBounds =
-                Union(centroidBounds, object->getBounds().Centroid());
-        int dim = centroidBounds.maxExtent();
-        std::sort(objects.begin(), objects.end(), [=](auto f1, auto f2) {
-            return f1->getBounds().Centroid()[dim] <
-                   f2->getBounds().Centroid()[dim];
-        });
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
+        node->bounds = bounds;
+        node->firstPrimOffset = start;
+        node->nPrimitives = nPrimitives;
+        return std::move(node);
+    };
+    if (nPrimitives == 1)
+        return makeLeaf();
 
-        auto leftshapes = std::vector<Object *>(beginning, middling);
-        auto rightshapes = std::vector<Object *>(middling, ending);
+    Bounds3 centroidBounds = Bounds3(primitiveInfo[start].centroid);
+    for (int i = start; i < end; ++i)
+        centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+    int dim = centroidBounds.maxExtent();
+    node->splitAxis = dim;
 
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+    auto beginning = primitiveInfo.begin() + start;
+    auto ending = primitiveInfo.begin() + end;
+    int mid = (start + end) / 2;
+    switch (splitMethod) {
+    case SplitMethod::SAH:
+    // only reached through rebuildSubtree, which keeps the references
+    case SplitMethod::SBVH:
+        mid = splitSAH(primitiveInfo, start, end, centroidBounds, bounds, dim);
+        if (mid < 0)
+            return makeLeaf();
+        break;
+    case SplitMethod::NAIVE:
+    default:
+        if (nPrimitives <= maxPrimsInNode)
+            return makeLeaf();
+        std::nth_element(beginning, primitiveInfo.begin() + mid, ending,
+                         [dim](const BVHPrimitiveInfo &a,
+                               const BVHPrimitiveInfo &b) {
+                             return a.centroid[dim] < b.centroid[dim];
+                         });
+        break;
+    }
+    assert(start < mid && mid < end);
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+    if (depth < parallelBuildDepth() &&
+        nPrimitives >= kParallelBuildThreshold) {
+        // The two halves are disjoint ranges of primitiveInfo, so they can
+        // be partitioned concurrently.
+        auto right = std::async(std::launch::async, [&, mid, end, depth] {
+            return recursiveBuild(primitiveInfo, mid, end, depth + 1);
+        });
+        node->left = recursiveBuild(primitiveInfo, start, mid, depth + 1);
+        node->right = right.get();
+    } else {
+        node->left = recursiveBuild(primitiveInfo, start, mid, depth + 1);
+        node->right = recursiveBuild(primitiveInfo, mid, end, depth + 1);
     }
     node->bounds = Union(node->left->bounds, node->right->bounds);
-    node->area = node->left->area + node->right->area;
     assert(bounds.pMin == node->bounds.pMin &&
            bounds.pMax == node->bounds.pMax);
     return node;
 }
 
-Intersection BVHAccel::Intersect(const Ray &ray) const {
-    Intersection isect;
-    if (!root)
-        return isect;
+// Binned SAH: primitives are bucketed by centroid along one axis and the
+// cost of every bucket boundary is evaluated with a sweep from both ends,
+// cost(i) = t_trav + (N_l * S_l + N_r * S_r) / S in units of one primitive
+// test. A node visit is costed like a primitive test, since primitives are
+// reached through a virtual call.
+static constexpr int kBuckets = 12;
+static constexpr float kTraversalCost = 1.f;
 
-    isect = BVHAccel::getIntersection(root.get(), ray);
-    return isect;
+namespace {
+struct ObjectSplit {
+    float cost = std::numeric_limits<float>::infinity();
+    int bucket = -1;
+    Bounds3 left, right;
+};
+} // namespace
+
+static int centroidBucket(const BVHPrimitiveInfo &info, int dim, float cmin,
+                          float cmax) {
+    int b = int(kBuckets * (info.centroid[dim] - cmin) / (cmax - cmin));
+    return std::clamp(b, 0, kBuckets - 1);
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode *node,
-                                       const Ray &ray) const {
-    if (!node->bounds.IntersectP(ray, ray.direction_inv)) {
-        return Intersection();
+// Cheapest bucket boundary for primitiveInfo[start, end) along dim, where
+// the centroids span [cmin, cmax] with cmin < cmax.
+static ObjectSplit
+findObjectSplit(const std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
+                int end, const Bounds3 &bounds, int dim, float cmin,
+                float cmax) {
+    struct Bucket {
+        int count = 0;
+        Bounds3 bounds;
+    };
+    std::array<Bucket, kBuckets> buckets;
+    for (int i = start; i < end; ++i) {
+        Bucket &bucket =
+            buckets[centroidBucket(primitiveInfo[i], dim, cmin, cmax)];
+        bucket.count++;
+        bucket.bounds = Union(bucket.bounds, primitiveInfo[i].bounds);
+    }
+
+    std::array<float, kBuckets - 1> cost{};
+    std::array<Bounds3, kBuckets - 1> below;
+    Bounds3 acc;
+    int countBelow = 0;
+    for (int i = 0; i < kBuckets - 1; ++i) {
+        acc = Union(acc, buckets[i].bounds);
+        below[i] = acc;
+        countBelow += buckets[i].count;
+        cost[i] = countBelow ? countBelow * acc.SurfaceArea() : 0;
     }
-    if (node->left != nullptr) {
-        Intersection interL = getIntersection(node->left.get(), ray);
-        if (!interL.happened) {
-            return getIntersection(node->right.get(), ray);
+    std::array<Bounds3, kBuckets - 1> above;
+    acc = Bounds3();
+    int countAbove = 0;
+    for (int i = kBuckets - 1; i > 0; --i) {
+        acc = Union(acc, buckets[i].bounds);
+        above[i - 1] = acc;
+        countAbove += buckets[i].count;
+        cost[i - 1] += countAbove ? countAbove * acc.SurfaceArea() : 0;
+    }
+    float invArea = 1.f / std::max<float>(bounds.SurfaceArea(), EPSILON);
+    ObjectSplit best;
+    for (int i = 0; i < kBuckets - 1; ++i) {
+        float c = kTraversalCost + cost[i] * invArea;
+        if (c < best.cost) {
+            best.cost = c;
+            best.bucket = i;
+            best.left = below[i];
+            best.right = above[i];
         }
-        Intersection interR = getIntersection(node->right.get(), ray);
-        if (interR.happened) {
-            return interL.distance < interR.distance ? interL : interR;
+    }
+    return best;
+}
+
+int BVHAccel::splitSAH(std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                       int start, int end, const Bounds3 &centroidBounds,
+                       const Bounds3 &bounds, int dim) const {
+    auto beginning = primitiveInfo.begin() + start;
+    auto ending = primitiveInfo.begin() + end;
+    int mid = (start + end) / 2;
+    auto byCentroid = [dim](const BVHPrimitiveInfo &a,
+                            const BVHPrimitiveInfo &b) {
+        return a.centroid[dim] < b.centroid[dim];
+    };
+    int nPrimitives = end - start;
+    float cmin = centroidBounds.pMin[dim], cmax = centroidBounds.pMax[dim];
+    if (cmax <= cmin) {
+        // All centroids coincide on this axis, bucketing can not separate
+        // them, keep them together or fall back to a median split.
+        if (nPrimitives <= maxPrimsInNode)
+            return -1;
+        std::nth_element(beginning, primitiveInfo.begin() + mid, ending,
+                         byCentroid);
+        return mid;
+    }
+
+    ObjectSplit split =
+        findObjectSplit(primitiveInfo, start, end, bounds, dim, cmin, cmax);
+    // A leaf costs one test per primitive; keep the node whole when that is
+    // cheaper than the best split and the leaf size allows it.
+    float leafCost = (float)nPrimitives;
+    if (nPrimitives <= maxPrimsInNode && split.cost >= leafCost)
+        return -1;
+
+    auto pmid = std::partition(beginning, ending,
+                               [&](const BVHPrimitiveInfo &info) {
+                                   return centroidBucket(info, dim, cmin,
+                                                         cmax) <= split.bucket;
+                               });
+    if (pmid == beginning || pmid == ending) {
+        // Every primitive landed on one side, split at the median instead.
+        if (nPrimitives <= maxPrimsInNode)
+            return -1;
+        std::nth_element(beginning, primitiveInfo.begin() + mid, ending,
+                         byCentroid);
+        return mid;
+    }
+    return (int)(pmid - primitiveInfo.begin());
+}
+
+// Spatial splits bin references by their extent rather than their
+// centroid. A reference is clipped to every bin it overlaps, so the bins
+// carry the tight bounds of the pieces; the counts record where references
+// start and end.
+static constexpr int kSpatialBins = 32;
+// Spatial splits are only tried where the children of the best object
+// split overlap by more than this fraction of the root's surface area.
+static constexpr float kSpatialSplitOverlap = 1e-5f;
+
+namespace {
+struct SpatialSplit {
+    float cost = std::numeric_limits<float>::infinity();
+    int dim = 0;
+    int bin = -1;
+    float position = 0;
+};
+} // namespace
+
+static Bounds3 clipToSlab(const Bounds3 &box, int dim, float lo, float hi) {
+    Bounds3 slab = box;
+    slab.pMin[dim] = std::max(box.pMin[dim], lo);
+    slab.pMax[dim] = std::min(box.pMax[dim], hi);
+    return slab;
+}
+
+static Bounds3 clipReference(const BVHPrimitiveInfo &ref, const Bounds3 &box,
+                             const BVHAccel::ClipFn &clip) {
+    if (!clip)
+        return box;
+    // the primitive's own clipping may round slightly outside the box
+    return clip((uint32_t)ref.primitiveNumber, box).Intersect(box);
+}
+
+static SpatialSplit findSpatialSplit(const std::vector<BVHPrimitiveInfo> &refs,
+                                     const Bounds3 &bounds,
+                                     const BVHAccel::ClipFn &clip) {
+    SpatialSplit best;
+    int dim = bounds.maxExtent();
+    float lo = bounds.pMin[dim], extent = bounds.pMax[dim] - lo;
+    if (!(extent > 0))
+        return best;
+    float binWidth = extent / kSpatialBins;
+    auto binOf = [&](float x) {
+        return std::clamp(int((x - lo) / binWidth), 0, kSpatialBins - 1);
+    };
+
+    struct Bin {
+        Bounds3 bounds;
+        int enter = 0, exit = 0;
+    };
+    std::array<Bin, kSpatialBins> bins;
+    for (const auto &ref : refs) {
+        int first = binOf(ref.bounds.pMin[dim]);
+        int last = binOf(ref.bounds.pMax[dim]);
+        for (int b = first; b <= last; ++b) {
+            Bounds3 piece = ref.bounds;
+            if (first != last)
+                piece = clipReference(
+                    ref,
+                    clipToSlab(ref.bounds, dim, lo + b * binWidth,
+                               lo + (b + 1) * binWidth),
+                    clip);
+            bins[b].bounds = Union(bins[b].bounds, piece);
         }
-        return interL;
-    } else {
-        return node->object->getIntersection(ray);
+        bins[first].enter++;
+        bins[last].exit++;
+    }
+
+    std::array<float, kSpatialBins - 1> cost{};
+    Bounds3 acc;
+    int countBelow = 0;
+    for (int i = 0; i < kSpatialBins - 1; ++i) {
+        acc = Union(acc, bins[i].bounds);
+        countBelow += bins[i].enter;
+        cost[i] = countBelow ? countBelow * acc.SurfaceArea() : 0;
     }
+    acc = Bounds3();
+    int countAbove = 0;
+    for (int i = kSpatialBins - 1; i > 0; --i) {
+        acc = Union(acc, bins[i].bounds);
+        countAbove += bins[i].exit;
+        cost[i - 1] += countAbove ? countAbove * acc.SurfaceArea() : 0;
+    }
+    float invArea = 1.f / std::max<float>(bounds.SurfaceArea(), EPSILON);
+    for (int i = 0; i < kSpatialBins - 1; ++i) {
+        float c = kTraversalCost + cost[i] * invArea;
+        if (c < best.cost) {
+            best.cost = c;
+            best.dim = dim;
+            best.bin = i;
+            best.position = lo + (i + 1) * binWidth;
+        }
+    }
+    return best;
 }
 
-void BVHAccel::getSample(BVHBuildNode *node, float p, Intersection &pos,
-                         float &pdf) {
-    if (node->left == nullptr) {
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
-        return;
+// Surface area that treats an empty box as zero.
+static float surfaceArea(const Bounds3 &b) {
+    Vector3f d = b.Diagonal();
+    if (d.x < 0 || d.y < 0 || d.z < 0)
+        return 0;
+    return (float)b.SurfaceArea();
+}
+
+std::unique_ptr<BVHBuildNode>
+BVHAccel::recursiveBuildSBVH(std::vector<BVHPrimitiveInfo> refs, int depth,
+                             SBVHBuildState &state) {
+    const ClipFn &clip = state.clip;
+    std::vector<BVHPrimitiveInfo> &ordered = state.ordered;
+    auto node = std::make_unique<BVHBuildNode>();
+    Bounds3 bounds;
+    for (const auto &ref : refs)
+        bounds = Union(bounds, ref.bounds);
+    int nRefs = (int)refs.size();
+    auto makeLeaf = [&]() {
+        node->bounds = bounds;
+        node->firstPrimOffset = (int)ordered.size();
+        node->nPrimitives = nRefs;
+        ordered.insert(ordered.end(), refs.begin(), refs.end());
+        return std::move(node);
+    };
+    if (nRefs == 1)
+        return makeLeaf();
+
+    Bounds3 centroidBounds(refs[0].centroid);
+    for (const auto &ref : refs)
+        centroidBounds = Union(centroidBounds, ref.centroid);
+    int dim = centroidBounds.maxExtent();
+    float cmin = centroidBounds.pMin[dim], cmax = centroidBounds.pMax[dim];
+    ObjectSplit objectSplit;
+    if (cmax > cmin)
+        objectSplit = findObjectSplit(refs, 0, nRefs, bounds, dim, cmin, cmax);
+
+    // Only look for a spatial split where the object split leaves the
+    // children overlapping noticeably, that is where duplicating pays off.
+    SpatialSplit spatialSplit;
+    bool overlapping =
+        objectSplit.bucket < 0 ||
+        surfaceArea(objectSplit.left.Intersect(objectSplit.right)) >
+            kSpatialSplitOverlap * state.rootArea;
+    // the traversal stacks bound the tree depth
+    constexpr int kMaxSpatialSplitDepth = 48;
+    if (state.duplicatesLeft > 0 && overlapping &&
+        depth < kMaxSpatialSplitDepth)
+        spatialSplit = findSpatialSplit(refs, bounds, clip);
+
+    float bestCost = std::min(objectSplit.cost, spatialSplit.cost);
+    if (nRefs <= maxPrimsInNode && bestCost >= (float)nRefs)
+        return makeLeaf();
+
+    std::vector<BVHPrimitiveInfo> left, right;
+    if (spatialSplit.cost < objectSplit.cost) {
+        int sdim = spatialSplit.dim;
+        float lo = bounds.pMin[sdim];
+        float binWidth = (bounds.pMax[sdim] - lo) / kSpatialBins;
+        auto binOf = [&](float x) {
+            return std::clamp(int((x - lo) / binWidth), 0, kSpatialBins - 1);
+        };
+        // Straddling references go to one side whole when that is cheaper
+        // than duplicating them (reference unsplitting).
+        std::vector<const BVHPrimitiveInfo *> straddling;
+        Bounds3 leftBounds, rightBounds;
+        for (const auto &ref : refs) {
+            if (binOf(ref.bounds.pMax[sdim]) <= spatialSplit.bin) {
+                left.push_back(ref);
+                leftBounds = Union(leftBounds, ref.bounds);
+            } else if (binOf(ref.bounds.pMin[sdim]) > spatialSplit.bin) {
+                right.push_back(ref);
+                rightBounds = Union(rightBounds, ref.bounds);
+            } else {
+                straddling.push_back(&ref);
+            }
+        }
+        int duplicates = 0;
+        float x = spatialSplit.position;
+        for (const BVHPrimitiveInfo *ref : straddling) {
+            Bounds3 l = clipReference(
+                *ref, clipToSlab(ref->bounds, sdim, ref->bounds.pMin[sdim], x),
+                clip);
+            Bounds3 r = clipReference(
+                *ref, clipToSlab(ref->bounds, sdim, x, ref->bounds.pMax[sdim]),
+                clip);
+            float nl = (float)left.size(), nr = (float)right.size();
+            float splitCost = surfaceArea(Union(leftBounds, l)) * (nl + 1) +
+                              surfaceArea(Union(rightBounds, r)) * (nr + 1);
+            float leftCost =
+                surfaceArea(Union(leftBounds, ref->bounds)) * (nl + 1) +
+                surfaceArea(rightBounds) * nr;
+            float rightCost =
+                surfaceArea(leftBounds) * nl +
+                surfaceArea(Union(rightBounds, ref->bounds)) * (nr + 1);
+            if (nr > 0 && leftCost <= std::min(splitCost, rightCost)) {
+                left.push_back(*ref);
+                leftBounds = Union(leftBounds, ref->bounds);
+            } else if (nl > 0 && rightCost <= splitCost) {
+                right.push_back(*ref);
+                rightBounds = Union(rightBounds, ref->bounds);
+            } else {
+                left.emplace_back(ref->primitiveNumber, l);
+                right.emplace_back(ref->primitiveNumber, r);
+                leftBounds = Union(leftBounds, l);
+                rightBounds = Union(rightBounds, r);
+                ++duplicates;
+            }
+        }
+        if (duplicates <= state.duplicatesLeft && (int)left.size() < nRefs &&
+            (int)right.size() < nRefs && !left.empty() && !right.empty()) {
+            state.duplicatesLeft -= duplicates;
+            node->splitAxis = sdim;
+        } else {
+            left.clear();
+            right.clear();
+        }
     }
-    if (p < node->left->area)
-        getSample(node->left.get(), p, pos, pdf);
-    else
-        getSample(node->right.get(), p - node->left->area, pos, pdf);
+    if (left.empty()) {
+        // Object split, or a median split when the centroids can not be
+        // separated.
+        node->splitAxis = dim;
+        auto middle = refs.begin() + nRefs / 2;
+        if (objectSplit.bucket >= 0) {
+            middle = std::partition(
+                refs.begin(), refs.end(), [&](const BVHPrimitiveInfo &ref) {
+                    return centroidBucket(ref, dim, cmin, cmax) <=
+                           objectSplit.bucket;
+                });
+        }
+        if (middle == refs.begin() || middle == refs.end()) {
+            if (nRefs <= maxPrimsInNode)
+                return makeLeaf();
+            middle = refs.begin() + nRefs / 2;
+            std::nth_element(refs.begin(), middle, refs.end(),
+                             [dim](const BVHPrimitiveInfo &a,
+                                   const BVHPrimitiveInfo &b) {
+                                 return a.centroid[dim] < b.centroid[dim];
+                             });
+        }
+        left.assign(refs.begin(), middle);
+        right.assign(middle, refs.end());
+    }
+    refs = std::vector<BVHPrimitiveInfo>();
+
+    // Leaves are appended to `ordered` as they are created, so the left
+    // subtree has to be finished before the right one starts.
+    node->left = recursiveBuildSBVH(std::move(left), depth + 1, state);
+    node->right = recursiveBuildSBVH(std::move(right), depth + 1, state);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    return node;
+}
+
+Bounds3 BVHAccel::WorldBound() const {
+    return nodes.empty() ? rootBounds : nodes[0].bounds;
+}
+
+Intersection BVHAccel::Intersect(const Ray &ray) const {
+    Intersection isect;
+    if (primitives.empty())
+        return isect;
+
+    // The closest hit so far bounds the ray segment, so boxes entered
+    // beyond it are skipped and primitives reject hits behind it. Surface
+    // attributes are only computed for the hit that remains.
+    float tMax = ray.t_max;
+    traverse<false>(ray, tMax, [&](int first, int count, float &tMax) {
+        bool found = false;
+        for (int i = first; i < first + count; ++i)
+            found |= primitives[i]->getIntersection(ray, tMax, isect);
+        return found;
+    });
+    if (isect.happened)
+        isect.obj->getSurfaceProperties(ray, isect);
+    return isect;
+}
+
+bool BVHAccel::IntersectP(const Ray &ray) const {
+    if (primitives.empty())
+        return false;
+
+    float tMax = ray.t_max;
+    return traverse<true>(ray, tMax, [&](int first, int count, float &) {
+        for (int i = first; i < first + count; ++i) {
+            if (primitives[i]->IntersectP(ray))
+                return true;
+        }
+        return false;
+    });
 }
 
 void BVHAccel::Sample(Intersection &pos, float &pdf) {
-    float p = std::sqrt(get_random_float()) * root->area;
-    getSample(root.get(), p, pos, pdf);
-    pdf /= root->area;
-}
\ No newline at end of file
+    float area = areaCdf.back();
+    float p = std::sqrt(get_random_float()) * area;
+    size_t i = std::upper_bound(areaCdf.begin(), areaCdf.end(), p) -
+               areaCdf.begin();
+    i = std::min(i, primitives.size() - 1);
+    primitives[i]->Sample(pos, pdf);
+    pdf *= primitives[i]->getArea();
+    pdf /= area;
+}
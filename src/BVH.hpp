@@ -6,9 +6,11 @@
 #define RAYTRACING_BVH_H
 
 #include <atomic>
+#include <cstdint>
 #include <vector>
 #include <memory>
 #include <ctime>
+#include <functional>
 #include <mutex>
 #include <unordered_map>
 
@@ -17,10 +19,26 @@
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
 #include "Vector.hpp"
+#include "WideBVH.hpp"
 
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct SBVHBuildState;
+
+// Compact node of the flattened tree, laid out in depth-first order so the
+// first child of an interior node always directly follows it.
+struct alignas(32) LinearBVHNode {
+    Bounds3 bounds;
+    union {
+        int primitivesOffset;  // leaf
+        int secondChildOffset; // interior
+    };
+    uint16_t nPrimitives; // 0 -> interior node
+    uint8_t axis;         // interior node: xyz
+    uint8_t pad[1];       // ensure 32 byte total size
+};
+static_assert(sizeof(LinearBVHNode) == 32);
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -28,37 +46,156 @@ class BVHAccel {
 
 public:
     // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    // SBVH adds spatial splits to SAH: references to primitives that
+    // straddle a split plane may be clipped and duplicated into both
+    // children, within duplicateBudget. LBVH trades tree quality for a
+    // linear time build from Morton order, for trees rebuilt every frame;
+    // TRBVH adds treelet restructuring to it, see BuildLBVH.
+    enum class SplitMethod { NAIVE, SAH, SBVH, LBVH, TRBVH };
+    // BINARY traverses the flattened binary tree, WIDE collapses it into
+    // 4 or 8 wide nodes (whichever the CPU supports) tested with SIMD.
+    // COMPRESSED quantizes the wide nodes to 8 bit bounds and releases the
+    // binary tree, for a fraction of the memory; refitting such a tree
+    // rebuilds it.
+    enum class NodeLayout { BINARY, WIDE, COMPRESSED };
 
     // BVHAccel Public Methods
-    explicit BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
-    explicit BVHAccel(const std::vector<std::unique_ptr<Object>>& p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    // Bounds of the part of a primitive inside `box`, which lies within the
+    // primitive's bounds. Spatial splits use it to tighten clipped
+    // references.
+    using ClipFn = std::function<Bounds3(uint32_t primitive, const Bounds3 &box)>;
+    // Extra references spatial splits may create, relative to the number
+    // of primitives.
+    static constexpr float kDuplicateBudget = 0.3f;
+
+    explicit BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE, NodeLayout layout = NodeLayout::BINARY, float duplicateBudget = kDuplicateBudget);
+    explicit BVHAccel(const std::vector<std::unique_ptr<Object>>& p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE, NodeLayout layout = NodeLayout::BINARY, float duplicateBudget = kDuplicateBudget);
+    // Builds over bare primitive bounds for callers that keep their own
+    // primitive storage. Leaves then index primitiveOrder, and Intersect,
+    // IntersectP and Sample are unavailable; use traverse. Without clip,
+    // spatial splits clip the bounds only.
+    explicit BVHAccel(const std::vector<Bounds3>& primitiveBounds, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE, NodeLayout layout = NodeLayout::BINARY, const ClipFn &clip = nullptr, float duplicateBudget = kDuplicateBudget);
+    // Adopts a flattened tree built earlier over bare bounds, e.g. one read
+    // back from a cache file. Only the wide layout is derived from it.
+    explicit BVHAccel(std::vector<LinearBVHNode> flatNodes, int maxPrimsInNode, SplitMethod splitMethod, NodeLayout layout);
     [[nodiscard]] Bounds3 WorldBound() const;
     ~BVHAccel() = default;
 
     [[nodiscard]] Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
     bool IntersectP(const Ray &ray) const;
-    std::unique_ptr<BVHBuildNode> root;
+    // Walks the active node layout front to back and hands every leaf that
+    // the ray segment reaches to leaf(firstPrimitive, nPrimitives, tMax),
+    // see TraverseWideBVH. Lets callers keep primitives in their own format.
+    template <bool AnyHit, typename LeafFn>
+    bool traverse(const Ray &ray, float &tMax, LeafFn &&leaf) const;
+
+    // Updates the tree after primitives moved: node bounds are refit bottom
+    // up in O(n), and subtrees whose surface area grew past
+    // rebuildThreshold times their area when built are rebuilt from
+    // scratch. Returns true if that reordered the primitives. The
+    // COMPRESSED layout keeps no binary tree to refit and is rebuilt
+    // entirely.
+    bool refit(float rebuildThreshold = kRebuildThreshold);
+    // Same for trees built over bare bounds; primitiveBounds are given in
+    // leaf order. On true, primitiveOrder maps the new leaf order to the
+    // previous one.
+    bool refit(const std::vector<Bounds3> &primitiveBounds,
+               float rebuildThreshold = kRebuildThreshold);
+    static constexpr float kRebuildThreshold = 2.f;
+
+    // Switches to another node layout, e.g. to COMPRESSED once a tree
+    // built over bare bounds has been cached. There is no way back from
+    // COMPRESSED.
+    void setLayout(NodeLayout newLayout);
 
     // BVHAccel Private Methods
-    std::unique_ptr<BVHBuildNode> recursiveBuild(std::vector<Object *>objects);
+    [[nodiscard]] bool isLinear() const {
+        return splitMethod == SplitMethod::LBVH ||
+               splitMethod == SplitMethod::TRBVH;
+    }
+    void build(const std::vector<Bounds3> &primitiveBounds,
+               const ClipFn &clip);
+    // Reorders primitives to leaf order and sets up area sampling.
+    void orderPrimitives();
+    // Running area sum over primitives; repeated references add nothing.
+    void buildAreaCdf();
+    // Builds the subtree over primitiveInfo[start, end), partitioning that
+    // range in place.
+    std::unique_ptr<BVHBuildNode>
+    recursiveBuild(std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
+                   int end, int depth);
+    // Spatial split builder over the references in refs (consumed).
+    // Leaves append their references to state.ordered.
+    std::unique_ptr<BVHBuildNode>
+    recursiveBuildSBVH(std::vector<BVHPrimitiveInfo> refs, int depth,
+                       SBVHBuildState &state);
+    int flattenBVHTree(const BVHBuildNode *node,
+                       std::vector<LinearBVHNode> &out, int *offset);
+    // Replaces the subtree rooted at nodes[root] by a fresh build over its
+    // primitives, recording their new order in primitiveOrder.
+    void rebuildSubtree(int root, const std::vector<Bounds3> &primitiveBounds);
+    void recordBuildAreas();
+    // Sets maxDepth from nodes, which the traversal stacks are sized by.
+    void measureDepth();
+    // Derives the wide node copy from nodes, if the layout asks for one.
+    void buildWideNodes();
+    // Drops everything the COMPRESSED layout does not traverse.
+    void releaseBinaryTree();
+    // Binned surface area heuristic split along `dim`, returns the partition
+    // point of primitiveInfo[start, end), or -1 if a leaf is cheaper.
+    int splitSAH(std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
+                 int end, const Bounds3 &centroidBounds, const Bounds3 &bounds,
+                 int dim) const;
+    template <bool AnyHit, typename LeafFn>
+    bool traverseBinary(const Ray &ray, float &tMax, LeafFn &&leaf) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    NodeLayout layout;
+    const float duplicateBudget = kDuplicateBudget;
+    // In leaf order; with spatial splits a primitive may appear repeatedly.
     std::vector<Object*> primitives;
+    // primitiveOrder[i] is the input index of the i-th primitive in leaf
+    // order. Owners of external primitive storage permute it accordingly and
+    // may release this.
+    std::vector<uint32_t> primitiveOrder;
+    std::vector<LinearBVHNode> nodes;
+    // Surface area of every node when it was built, the reference for
+    // deciding when a refit subtree needs a rebuild.
+    std::vector<float> buildAreas;
+    // Wide copy of nodes, only one of them is filled, see width and layout
+    int width = 2;
+    std::vector<WideBVHNode<4>> wideNodes4;
+    std::vector<WideBVHNode<8>> wideNodes8;
+    std::vector<CompressedWideBVHNode<4>> compressedNodes4;
+    std::vector<CompressedWideBVHNode<8>> compressedNodes8;
+    // Edges on the longest root to leaf path of nodes, kept when nodes are
+    // released. Nothing bounds it for Morton order builds.
+    int maxDepth = 0;
+    // nodes[0].bounds, kept when nodes are released
+    Bounds3 rootBounds;
+    // Running sum of primitive areas, in primitives order, used to pick a
+    // primitive proportionally to its area.
+    std::vector<float> areaCdf;
 
-    void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
     void Sample(Intersection &pos, float &pdf);
 };
 
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() = default;
+    BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3 &bounds)
+        : primitiveNumber(primitiveNumber), bounds(bounds),
+          centroid(bounds.Centroid()) {}
+    size_t primitiveNumber{};
+    Bounds3 bounds;
+    Vector3f centroid;
+};
+
 struct BVHBuildNode {
     Bounds3 bounds;
     std::unique_ptr<BVHBuildNode> left = nullptr;
     std::unique_ptr<BVHBuildNode> right = nullptr;
-    Object* object = nullptr;
-    float area{};
 
 public:
     int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
@@ -66,8 +203,75 @@ public:
     BVHBuildNode(){
         bounds = Bounds3();
         left = nullptr;right = nullptr;
-        object = nullptr;
     }
 };
 
+template <bool AnyHit, typename LeafFn>
+inline bool BVHAccel::traverse(const Ray &ray, float &tMax,
+                               LeafFn &&leaf) const {
+    bool compressed = layout == NodeLayout::COMPRESSED;
+    switch (width) {
+    case 4:
+        return compressed ? TraverseWideBVH<4, AnyHit>(
+                                compressedNodes4, maxDepth, ray, tMax, leaf)
+                          : TraverseWideBVH<4, AnyHit>(wideNodes4, maxDepth,
+                                                       ray, tMax, leaf);
+    case 8:
+        return compressed ? TraverseWideBVH<8, AnyHit>(
+                                compressedNodes8, maxDepth, ray, tMax, leaf)
+                          : TraverseWideBVH<8, AnyHit>(wideNodes8, maxDepth,
+                                                       ray, tMax, leaf);
+    default:
+        return traverseBinary<AnyHit>(ray, tMax, leaf);
+    }
+}
+
+template <bool AnyHit, typename LeafFn>
+inline bool BVHAccel::traverseBinary(const Ray &ray, float &tMax,
+                                     LeafFn &&leaf) const {
+    const Vector3f &invDir = ray.direction_inv;
+    std::array<int, 3> dirIsNeg = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+
+    // Follow ray through BVH nodes to find primitive intersections
+    bool hit = false;
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int inlineStack[kInlineStackDepth];
+    std::unique_ptr<int[]> heapStack;
+    int *nodesToVisit = inlineStack;
+    if (maxDepth > kInlineStackDepth) {
+        heapStack.reset(new int[maxDepth]);
+        nodesToVisit = heapStack.get();
+    }
+    while (true) {
+        const LinearBVHNode *node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg, tMax)) {
+            if (node->nPrimitives > 0) {
+                if (leaf(node->primitivesOffset, node->nPrimitives, tMax)) {
+                    hit = true;
+                    if (AnyHit)
+                        return true;
+                }
+                if (toVisitOffset == 0)
+                    break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else {
+                // Visit the child on the near side of the split plane first
+                // so the far one is likely pruned by the closest hit.
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                } else {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        } else {
+            if (toVisitOffset == 0)
+                break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return hit;
+}
+
 #endif //RAYTRACING_BVH_H
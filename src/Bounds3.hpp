@@ -11,6 +11,14 @@
 #include "Ray.hpp"
 #include "Vector.hpp"
 
+// Each slab distance is rounded up to three times, so a ray through an edge
+// or corner of a box can exit before it enters by a few ulps. Slab tests
+// scale the exit distance by this (pbrt's 1 + 2 gamma(3)) to stay
+// conservative.
+constexpr float kSlabExitScale =
+    1 + 2 * (3 * std::numeric_limits<float>::epsilon() * 0.5f) /
+            (1 - 3 * std::numeric_limits<float>::epsilon() * 0.5f);
+
 /**
  * 3D boundary
  */
@@ -84,6 +92,11 @@ public:
 
   [[nodiscard]] inline bool
   IntersectP(const Ray &ray, const Vector3f &invDir) const;
+  // Slab test against the ray segment [ray.t_min, tMax]. dirIsNeg selects
+  // the near/far plane per axis so no swaps are needed.
+  [[nodiscard]] inline bool IntersectP(const Ray &ray, const Vector3f &invDir,
+                                       const std::array<int, 3> &dirIsNeg,
+                                       float tMax) const;
 };
 
 inline bool Bounds3::IntersectP(const Ray &ray, const Vector3f &invDir) const {
@@ -103,7 +116,7 @@ inline bool Bounds3::IntersectP(const Ray &ray, const Vector3f &invDir) const {
 
   txmin = std::max(txmin, tymin);
   txmax = std::min(txmax, tymax);
-  if (txmin > txmax)
+  if (txmin > txmax * kSlabExitScale)
     return false;
 
   float tzmin = (pMin.z - ray.origin.z) * invDir.z;
@@ -114,7 +127,23 @@ inline bool Bounds3::IntersectP(const Ray &ray, const Vector3f &invDir) const {
 
   txmin = std::max(std::max(txmin, tzmin), 0.f);
   txmax = std::min(txmax, tzmax);
-  return txmax >= txmin;
+  return txmax * kSlabExitScale >= txmin;
+}
+
+inline bool Bounds3::IntersectP(const Ray &ray, const Vector3f &invDir,
+                                const std::array<int, 3> &dirIsNeg,
+                                float tMax) const {
+  const Bounds3 &bounds = *this;
+  float tMin = (bounds[dirIsNeg[0]].x - ray.origin.x) * invDir.x;
+  float txMax = (bounds[1 - dirIsNeg[0]].x - ray.origin.x) * invDir.x;
+  float tyMin = (bounds[dirIsNeg[1]].y - ray.origin.y) * invDir.y;
+  float tyMax = (bounds[1 - dirIsNeg[1]].y - ray.origin.y) * invDir.y;
+  float tzMin = (bounds[dirIsNeg[2]].z - ray.origin.z) * invDir.z;
+  float tzMax = (bounds[1 - dirIsNeg[2]].z - ray.origin.z) * invDir.z;
+
+  tMin = std::max(std::max(tMin, tyMin), std::max(tzMin, ray.t_min));
+  tMax = std::min(std::min(txMax, tyMax), std::min(tzMax, tMax));
+  return tMin <= tMax * kSlabExitScale;
 }
 
 inline Bounds3 Union(const Bounds3 &b1, const Bounds3 &b2) {
@@ -0,0 +1,113 @@
+//
+// Object placed in the scene through an affine transform.
+//
+
+#ifndef RAYTRACING_INSTANCE_H
+#define RAYTRACING_INSTANCE_H
+
+#include <cmath>
+#include <memory>
+
+#include "Object.hpp"
+#include "Transform.hpp"
+
+// Shares one immutable object, typically a MeshTriangle with its own
+// (bottom level) BVH, between any number of placements. The scene BVH sees
+// each instance as one primitive with world space bounds, and rays are
+// mapped into object space at the instance boundary, so an instance costs
+// a transform instead of a copy of the geometry. Mirroring transforms turn
+// the winding of the faces, and with it which side is culled and which way
+// the normals point, as for the same mesh with the transform baked in.
+class Instance : public Object {
+  public:
+    Instance(std::shared_ptr<const Object> object, const Transform &toWorld)
+        : object(std::move(object)) {
+        setTransform(toWorld);
+    }
+
+    // Moves the instance. Also call it (with the current transform) after
+    // the shared object changed shape. The scene picks the change up on
+    // Scene::refitBVH.
+    void setTransform(const Transform &transform) {
+        toWorld = transform;
+        worldBounds = toWorld.Bounds(object->getBounds());
+        area = object->getTransformedArea(toWorld);
+        mirrored = toWorld.Determinant() < 0;
+    }
+    [[nodiscard]] const Transform &getTransform() const { return toWorld; }
+
+    bool getIntersection(const Ray &ray, float &tMax,
+                         Intersection &isect) const override {
+        // The direction is not renormalized, so distances along the object
+        // space ray equal those along the world space one, and tMax carries
+        // over unchanged.
+        if (!object->getIntersection(localRay(ray), tMax, isect))
+            return false;
+        isect.obj = this;
+        return true;
+    }
+
+    void getSurfaceProperties(const Ray &ray,
+                              Intersection &isect) const override {
+        // the shared object only reads its own part of the record
+        object->getSurfaceProperties(localRay(ray), isect);
+        isect.coords = ray(isect.distance);
+        isect.normal = worldNormal(isect.normal);
+        isect.obj = this;
+    }
+
+    bool IntersectP(const Ray &ray) const override {
+        return object->IntersectP(localRay(ray));
+    }
+
+    Bounds3 getBounds() const override { return worldBounds; }
+
+    void Sample(Intersection &pos, float &pdf) const override {
+        object->Sample(pos, pdf);
+        // The transform stretches a surface element with unit normal n by
+        // |det A| * |A^-T n|, which divides the area density.
+        Vector3f normal = toWorld.Normal(pos.normal);
+        float stretch = std::abs(toWorld.Determinant()) * normal.norm();
+        pos.coords = toWorld.Point(pos.coords);
+        pos.normal = worldNormal(pos.normal);
+        pos.obj = this;
+        pdf /= stretch;
+    }
+    float getArea() const override { return area; }
+    float getTransformedArea(const Transform &transform) const override {
+        return object->getTransformedArea(transform * toWorld);
+    }
+    float samplePdf(const Intersection &pos) const override {
+        // The stretch of Sample, from the world space normal: with n the
+        // unit object space normal, A^T maps pos.normal onto n / |A^-T n|.
+        Vector3f normal = toWorld.InverseNormal(pos.normal);
+        Intersection local = pos;
+        local.coords = toWorld.InversePoint(pos.coords);
+        local.normal = normalize(mirrored ? -normal : normal);
+        return object->samplePdf(local) * normal.norm() /
+               std::abs(toWorld.Determinant());
+    }
+    bool hasEmit() const override { return object->hasEmit(); }
+
+  private:
+    Ray localRay(const Ray &ray) const {
+        Ray local(toWorld.InversePoint(ray.origin),
+                  toWorld.InverseVector(ray.direction));
+        local.t_min = ray.t_min;
+        local.t_max = ray.t_max;
+        local.mirrored = ray.mirrored != mirrored;
+        return local;
+    }
+    Vector3f worldNormal(const Vector3f &normal) const {
+        Vector3f n = normalize(toWorld.Normal(normal));
+        return mirrored ? -n : n;
+    }
+
+    std::shared_ptr<const Object> object;
+    Transform toWorld;
+    Bounds3 worldBounds;
+    float area;
+    bool mirrored;
+};
+
+#endif // RAYTRACING_INSTANCE_H
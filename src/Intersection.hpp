@@ -4,28 +4,28 @@
 
 #ifndef RAYTRACING_INTERSECTION_H
 #define RAYTRACING_INTERSECTION_H
+#include <cstdint>
+#include <limits>
 #include "Vector.hpp"
 #include "Material.hpp"
 class Object;
 class Sphere;
 
+// Filled in two steps. Object::getIntersection only records which
+// primitive was hit where: distance, obj and the primitive's own index and
+// barycentrics. Object::getSurfaceProperties then adds coords, normal and
+// material, once, for the closest hit. Emission is the material's, see
+// Material::getEmission.
 struct Intersection
 {
-    Intersection(){
-        happened=false;
-        coords=Vector3f();
-        normal=Vector3f();
-        distance= std::numeric_limits<double>::max();
-        obj =nullptr;
-        m=nullptr;
-    }
-    bool happened;
+    bool happened = false;
+    float distance = std::numeric_limits<float>::max();
+    const Object* obj = nullptr;
+    uint32_t index = 0;
+    float u = 0, v = 0;
+
     Vector3f coords;
-    Vector3f tcoords;
     Vector3f normal;
-    Vector3f emit;
-    double distance;
-    const Object* obj;
-    const Material* m;
+    const Material* m = nullptr;
 };
 #endif //RAYTRACING_INTERSECTION_H
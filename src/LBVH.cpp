@@ -0,0 +1,487 @@
+#include "LBVH.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <memory>
+#include <thread>
+
+#include "BVH.hpp"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Same cost model as the binned SAH builder: a node visit costs as much as
+// a primitive test.
+static constexpr float kTraversalCost = 1.f;
+// Loops over fewer items than this stay on the calling thread.
+static constexpr size_t kParallelThreshold = 1 << 14;
+// 30 bit codes resolve 1024 cells per axis, which for surfaces leaves
+// about one primitive per cell up to a few million primitives. Beyond
+// that, 63 bit codes keep neighbours apart at twice the sorting cost.
+static constexpr size_t kMorton63Threshold = 1 << 22;
+static constexpr int kRadixBits = 10;
+// A treelet of 7 leaves has 10395 topologies, which the subset dynamic
+// program below searches in about 2000 steps.
+static constexpr int kTreeletLeaves = 7;
+// Treelets are formed below nodes with at least this many primitives,
+// doubling every round.
+static constexpr uint32_t kTreeletMinPrimitives = kTreeletLeaves;
+static constexpr int kTreeletRounds = 3;
+static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+static int countLeadingZeros(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return x ? __builtin_clzll(x) : 64;
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    unsigned long index;
+    return _BitScanReverse64(&index, x) ? 63 - (int)index : 64;
+#else
+    int n = 0;
+    for (uint64_t bit = uint64_t(1) << 63; bit && !(x & bit); bit >>= 1)
+        ++n;
+    return n;
+#endif
+}
+
+static unsigned chunkCount(size_t n) {
+    static const unsigned workers =
+        std::max(1u, std::thread::hardware_concurrency());
+    return n < kParallelThreshold ? 1 : workers;
+}
+
+// Calls fn(chunk, begin, end) for the chunkCount(n) disjoint chunks of
+// [0, n), concurrently if there is more than one.
+template <typename Fn> static void parallelChunks(size_t n, Fn &&fn) {
+    unsigned chunks = chunkCount(n);
+    std::vector<std::future<void>> pending;
+    for (unsigned c = 1; c < chunks; ++c) {
+        pending.push_back(std::async(std::launch::async, [&fn, n, c, chunks] {
+            fn(c, n * c / chunks, n * (c + 1) / chunks);
+        }));
+    }
+    fn(0u, size_t(0), n / chunks);
+    for (auto &f : pending)
+        f.get();
+}
+
+// Spreads the low 10 bits of v so that two zero bits follow each.
+static uint32_t expandBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Same for the low 21 bits.
+static uint64_t expandBits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// Interleaves the coordinates of p, which lies in [0, 1]^3.
+template <typename Key> static Key mortonCode(const Vector3f &p) {
+    constexpr int bitsPerAxis = sizeof(Key) == 4 ? 10 : 21;
+    constexpr float cells = float(1u << bitsPerAxis);
+    auto quantize = [](float x) {
+        return (Key)std::clamp(x * cells, 0.f, cells - 1);
+    };
+    return expandBits(quantize(p.x)) << 2 | expandBits(quantize(p.y)) << 1 |
+           expandBits(quantize(p.z));
+}
+
+namespace {
+template <typename Key> struct MortonPrimitive {
+    Key code;
+    uint32_t index;
+};
+
+// Binary tree over the Morton sorted primitives. Ids below nInterior are
+// interior nodes, leaf k (sorted[k]) has id nInterior + k.
+struct LBVHTree {
+    explicit LBVHTree(size_t nPrimitives)
+        : nInterior((uint32_t)nPrimitives - 1), child(nInterior),
+          parent(2 * nPrimitives - 1, kNone), bounds(nInterior),
+          count(2 * nPrimitives - 1), cost(2 * nPrimitives - 1),
+          flatSize(2 * nPrimitives - 1), sorted(nPrimitives) {}
+
+    [[nodiscard]] bool isLeaf(uint32_t id) const { return id >= nInterior; }
+    [[nodiscard]] const Bounds3 &nodeBounds(uint32_t id) const {
+        return isLeaf(id) ? sorted[id - nInterior].bounds : bounds[id];
+    }
+
+    // Recomputes the summary of interior node id from its children.
+    void update(uint32_t id, int maxPrimsInNode) {
+        auto [l, r] = child[id];
+        bounds[id] = Union(nodeBounds(l), nodeBounds(r));
+        count[id] = count[l] + count[r];
+        float area = (float)bounds[id].SurfaceArea();
+        float splitCost = kTraversalCost * area + cost[l] + cost[r];
+        float leafCost = area * (float)count[id];
+        if (count[id] <= (uint32_t)maxPrimsInNode && leafCost <= splitCost) {
+            cost[id] = leafCost;
+            flatSize[id] = 1;
+        } else {
+            cost[id] = splitCost;
+            flatSize[id] = 1 + flatSize[l] + flatSize[r];
+        }
+    }
+
+    uint32_t nInterior;
+    std::vector<std::array<uint32_t, 2>> child;
+    std::vector<uint32_t> parent;
+    // of the interior nodes
+    std::vector<Bounds3> bounds;
+    // primitives below the node
+    std::vector<uint32_t> count;
+    // SAH cost of the subtree, where subtrees that collapse into one leaf
+    // are costed as that leaf
+    std::vector<float> cost;
+    // nodes of the flattened subtree, 1 if it collapses into a leaf
+    std::vector<uint32_t> flatSize;
+    // the primitives in Morton order
+    std::vector<BVHPrimitiveInfo> sorted;
+};
+} // namespace
+
+// Stable LSD radix sort over the low keyBits bits of the codes. Each chunk
+// counts its digits, and the digit major, chunk minor prefix sum gives
+// every chunk its own output ranges to scatter into.
+template <typename Key>
+static void radixSort(std::vector<MortonPrimitive<Key>> &items, int keyBits) {
+    constexpr size_t kDigits = size_t(1) << kRadixBits;
+    size_t n = items.size();
+    std::vector<MortonPrimitive<Key>> sorted(n);
+    std::vector<std::array<size_t, kDigits>> offsets(chunkCount(n));
+    for (int shift = 0; shift < keyBits; shift += kRadixBits) {
+        auto digit = [shift](Key code) {
+            return size_t(code >> shift) & (kDigits - 1);
+        };
+        parallelChunks(n, [&](unsigned c, size_t begin, size_t end) {
+            offsets[c].fill(0);
+            for (size_t i = begin; i < end; ++i)
+                ++offsets[c][digit(items[i].code)];
+        });
+        // nothing to do if all codes share this digit
+        size_t first = digit(items[0].code), firstCount = 0;
+        for (const auto &chunk : offsets)
+            firstCount += chunk[first];
+        if (firstCount == n)
+            continue;
+        size_t sum = 0;
+        for (size_t d = 0; d < kDigits; ++d) {
+            for (auto &chunk : offsets) {
+                size_t count = chunk[d];
+                chunk[d] = sum;
+                sum += count;
+            }
+        }
+        parallelChunks(n, [&](unsigned c, size_t begin, size_t end) {
+            auto &next = offsets[c];
+            for (size_t i = begin; i < end; ++i)
+                sorted[next[digit(items[i].code)]++] = items[i];
+        });
+        items.swap(sorted);
+    }
+}
+
+// Sorts the primitives along the Morton curve and links the interior
+// nodes; bounds are left to sweepUp.
+template <typename Key>
+static void buildHierarchy(const std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                           LBVHTree &tree) {
+    size_t n = primitiveInfo.size();
+    std::vector<Bounds3> chunkBounds(chunkCount(n));
+    parallelChunks(n, [&](unsigned c, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            chunkBounds[c] = Union(chunkBounds[c], primitiveInfo[i].centroid);
+    });
+    Bounds3 centroidBounds;
+    for (const auto &b : chunkBounds)
+        centroidBounds = Union(centroidBounds, b);
+
+    std::vector<MortonPrimitive<Key>> morton(n);
+    parallelChunks(n, [&](unsigned, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            morton[i] = {mortonCode<Key>(
+                             centroidBounds.Offset(primitiveInfo[i].centroid)),
+                         (uint32_t)i};
+        }
+    });
+    radixSort(morton, sizeof(Key) == 4 ? 30 : 63);
+
+    // Length of the common prefix of the codes at i and j, with the
+    // position appended to the code so that equal codes differ too.
+    // Positions outside the array have no common prefix.
+    auto delta = [&](int64_t i, int64_t j) {
+        if (j < 0 || j >= (int64_t)n)
+            return -1;
+        Key a = morton[i].code, b = morton[j].code;
+        return a != b ? countLeadingZeros(uint64_t(a ^ b))
+                      : 64 + countLeadingZeros(uint64_t(i ^ j));
+    };
+    // Interior node i covers the longest range starting or ending at i
+    // whose codes share a longer prefix than i has with the neighbour
+    // outside the range; it splits where that prefix grows.
+    parallelChunks(n - 1, [&](unsigned, size_t begin, size_t end) {
+        for (int64_t i = (int64_t)begin; i < (int64_t)end; ++i) {
+            int64_t d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+            int minPrefix = delta(i, i - d);
+            int64_t lMax = 2;
+            while (delta(i, i + lMax * d) > minPrefix)
+                lMax *= 2;
+            int64_t l = 0;
+            for (int64_t t = lMax / 2; t >= 1; t /= 2) {
+                if (delta(i, i + (l + t) * d) > minPrefix)
+                    l += t;
+            }
+            int64_t j = i + l * d;
+            int nodePrefix = delta(i, j);
+            int64_t s = 0, t = l;
+            do {
+                t = (t + 1) / 2;
+                if (delta(i, i + (s + t) * d) > nodePrefix)
+                    s += t;
+            } while (t > 1);
+            int64_t split = i + s * d + std::min<int64_t>(d, 0);
+
+            uint32_t left = std::min(i, j) == split
+                                ? tree.nInterior + (uint32_t)split
+                                : (uint32_t)split;
+            uint32_t right = std::max(i, j) == split + 1
+                                 ? tree.nInterior + (uint32_t)split + 1
+                                 : (uint32_t)split + 1;
+            tree.child[i] = {left, right};
+            tree.parent[left] = (uint32_t)i;
+            tree.parent[right] = (uint32_t)i;
+        }
+    });
+
+    parallelChunks(n, [&](unsigned, size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+            uint32_t id = tree.nInterior + (uint32_t)k;
+            tree.sorted[k] = primitiveInfo[morton[k].index];
+            tree.count[id] = 1;
+            tree.cost[id] = (float)tree.sorted[k].bounds.SurfaceArea();
+            tree.flatSize[id] = 1;
+        }
+    });
+}
+
+// Replaces the topology of the treelet below root by the SAH optimal one.
+// The treelet grows from root by repeatedly opening its largest interior
+// leaf; its interior nodes are reused for the new topology.
+static void restructureTreelet(LBVHTree &tree, uint32_t root,
+                               int maxPrimsInNode) {
+    std::array<uint32_t, kTreeletLeaves> leaves{};
+    std::array<uint32_t, kTreeletLeaves - 1> interiors{};
+    int nLeaves = 2, nInteriors = 1;
+    leaves[0] = tree.child[root][0];
+    leaves[1] = tree.child[root][1];
+    interiors[0] = root;
+    while (nLeaves < kTreeletLeaves) {
+        int largest = -1;
+        double largestArea = -1;
+        for (int i = 0; i < nLeaves; ++i) {
+            if (tree.isLeaf(leaves[i]))
+                continue;
+            double area = tree.bounds[leaves[i]].SurfaceArea();
+            if (area > largestArea) {
+                largest = i;
+                largestArea = area;
+            }
+        }
+        if (largest < 0)
+            break;
+        uint32_t opened = leaves[largest];
+        interiors[nInteriors++] = opened;
+        leaves[largest] = tree.child[opened][0];
+        leaves[nLeaves++] = tree.child[opened][1];
+    }
+
+    // Cheapest cost of every subset of the treelet leaves, from smaller to
+    // larger subsets; a subset's proper subsets have smaller masks.
+    constexpr int kSubsets = 1 << kTreeletLeaves;
+    std::array<Bounds3, kSubsets> bounds;
+    std::array<uint32_t, kSubsets> count{};
+    std::array<float, kSubsets> cost{};
+    std::array<uint8_t, kSubsets> partition{};
+    int all = (1 << nLeaves) - 1;
+    for (int s = 1; s <= all; ++s) {
+        int lowest = s & -s;
+        if (s == lowest) {
+            uint32_t leaf = leaves[63 - countLeadingZeros((uint64_t)s)];
+            bounds[s] = tree.nodeBounds(leaf);
+            count[s] = tree.count[leaf];
+            cost[s] = tree.cost[leaf];
+            continue;
+        }
+        bounds[s] = Union(bounds[s ^ lowest], bounds[lowest]);
+        count[s] = count[s ^ lowest] + count[lowest];
+        // Only partitions with the lowest leaf on the left side, so every
+        // split is considered once.
+        float splitCost = std::numeric_limits<float>::infinity();
+        int bestPartition = 0;
+        int rest = s ^ lowest;
+        for (int q = (rest - 1) & rest;; q = (q - 1) & rest) {
+            int p = q | lowest;
+            float c = cost[p] + cost[s ^ p];
+            // branch free, the comparison is unpredictable
+            bestPartition = c < splitCost ? p : bestPartition;
+            splitCost = std::min(c, splitCost);
+            if (q == 0)
+                break;
+        }
+        partition[s] = (uint8_t)bestPartition;
+        float area = (float)bounds[s].SurfaceArea();
+        cost[s] = kTraversalCost * area + splitCost;
+        if (count[s] <= (uint32_t)maxPrimsInNode)
+            cost[s] = std::min(cost[s], area * (float)count[s]);
+    }
+    if (!(cost[all] < tree.cost[root]))
+        return;
+
+    int nextInterior = 1;
+    auto rebuild = [&](auto &self, int s, uint32_t node) -> void {
+        std::array<int, 2> sides = {partition[s], s ^ partition[s]};
+        for (int side = 0; side < 2; ++side) {
+            int subset = sides[side];
+            uint32_t id;
+            if ((subset & (subset - 1)) == 0) {
+                id = leaves[63 - countLeadingZeros((uint64_t)subset)];
+            } else {
+                id = interiors[nextInterior++];
+                self(self, subset, id);
+            }
+            tree.child[node][side] = id;
+            tree.parent[id] = node;
+        }
+        tree.update(node, maxPrimsInNode);
+    };
+    rebuild(rebuild, all, root);
+}
+
+// Computes bounds, counts and costs from the leaves up, in parallel: of
+// the two threads arriving at a node, the second one finds both subtrees
+// complete and carries on to the parent. Nodes with at least
+// minTreeletPrimitives primitives have their treelet restructured once
+// their subtree is final; 0 disables restructuring.
+static void sweepUp(LBVHTree &tree, int maxPrimsInNode,
+                    uint32_t minTreeletPrimitives) {
+    std::unique_ptr<std::atomic<uint32_t>[]> arrivals(
+        new std::atomic<uint32_t>[tree.nInterior]);
+    parallelChunks(tree.nInterior, [&](unsigned, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            arrivals[i].store(0, std::memory_order_relaxed);
+    });
+    parallelChunks(tree.nInterior + 1, [&](unsigned, size_t begin,
+                                           size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+            uint32_t id = tree.parent[tree.nInterior + k];
+            while (id != kNone &&
+                   arrivals[id].fetch_add(1, std::memory_order_acq_rel) == 1) {
+                tree.update(id, maxPrimsInNode);
+                if (minTreeletPrimitives > 0 &&
+                    tree.count[id] >= minTreeletPrimitives)
+                    restructureTreelet(tree, id, maxPrimsInNode);
+                id = tree.parent[id];
+            }
+        }
+    });
+}
+
+// Writes the subtree of id to nodes[nodeOffset, nodeOffset + flatSize) in
+// depth-first order, and its primitives to ordered[primOffset, ...).
+static void flatten(const LBVHTree &tree, uint32_t id, uint32_t nodeOffset,
+                    uint32_t primOffset,
+                    std::vector<BVHPrimitiveInfo> &ordered,
+                    std::vector<LinearBVHNode> &nodes, int depth) {
+    LinearBVHNode &node = nodes[nodeOffset];
+    node.bounds = tree.nodeBounds(id);
+    if (tree.flatSize[id] == 1) {
+        node.primitivesOffset = (int)primOffset;
+        node.nPrimitives = (uint16_t)tree.count[id];
+        // a subtree of k leaves is at most k - 1 levels deep
+        uint32_t stack[256];
+        int top = 0;
+        stack[top++] = id;
+        while (top > 0) {
+            uint32_t next = stack[--top];
+            if (tree.isLeaf(next)) {
+                ordered[primOffset++] = tree.sorted[next - tree.nInterior];
+            } else {
+                stack[top++] = tree.child[next][1];
+                stack[top++] = tree.child[next][0];
+            }
+        }
+        return;
+    }
+
+    auto [l, r] = tree.child[id];
+    Vector3f d =
+        tree.nodeBounds(l).Centroid() - tree.nodeBounds(r).Centroid();
+    d = Vector3f(std::abs(d.x), std::abs(d.y), std::abs(d.z));
+    node.axis = d.x > d.y && d.x > d.z ? 0 : (d.y > d.z ? 1 : 2);
+    node.nPrimitives = 0;
+    uint32_t rightOffset = nodeOffset + 1 + tree.flatSize[l];
+    node.secondChildOffset = (int)rightOffset;
+    auto flattenRight = [&, r = r] {
+        flatten(tree, r, rightOffset, primOffset + tree.count[l],
+                ordered, nodes, depth + 1);
+    };
+    // The two subtrees write disjoint ranges. Split off threads until
+    // there is one per worker.
+    if (depth < 16 && (1u << depth) < chunkCount(tree.count[id])) {
+        auto right = std::async(std::launch::async, flattenRight);
+        flatten(tree, l, nodeOffset + 1, primOffset, ordered, nodes,
+                depth + 1);
+        right.get();
+    } else {
+        flatten(tree, l, nodeOffset + 1, primOffset, ordered, nodes,
+                depth + 1);
+        flattenRight();
+    }
+}
+
+void BuildLBVH(std::vector<BVHPrimitiveInfo> &primitiveInfo,
+               int maxPrimsInNode, bool optimizeTreelets,
+               std::vector<LinearBVHNode> &nodes) {
+    nodes.clear();
+    size_t n = primitiveInfo.size();
+    if (n == 0)
+        return;
+    if (n == 1) {
+        nodes.resize(1);
+        nodes[0].bounds = primitiveInfo[0].bounds;
+        nodes[0].primitivesOffset = 0;
+        nodes[0].nPrimitives = 1;
+        return;
+    }
+
+    LBVHTree tree(n);
+    if (n > kMorton63Threshold)
+        buildHierarchy<uint64_t>(primitiveInfo, tree);
+    else
+        buildHierarchy<uint32_t>(primitiveInfo, tree);
+
+    sweepUp(tree, maxPrimsInNode,
+            optimizeTreelets ? kTreeletMinPrimitives : 0);
+    if (optimizeTreelets) {
+        for (int round = 1; round < kTreeletRounds; ++round)
+            sweepUp(tree, maxPrimsInNode, kTreeletMinPrimitives << round);
+    }
+
+    // the tree holds its own copy of the primitives
+    nodes.resize(tree.flatSize[0]);
+    flatten(tree, 0, 0, 0, primitiveInfo, nodes, 0);
+}
@@ -5,6 +5,8 @@
 #ifndef RAYTRACING_MATERIAL_H
 #define RAYTRACING_MATERIAL_H
 
+#include <memory>
+
 #include "Vector.hpp"
 #include "global.hpp"
 
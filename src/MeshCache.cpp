@@ -0,0 +1,126 @@
+#include "MeshCache.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+static uint64_t mix(uint64_t h, uint64_t word) {
+    h ^= word;
+    h *= 0x9e3779b97f4a7c15ull;
+    return h ^ (h >> 32);
+}
+
+uint64_t HashFileContent(const std::string &path, uint64_t seed) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return 0;
+    // Word at a time, so hashing stays far cheaper than parsing the model.
+    std::vector<char> buffer(1 << 20);
+    uint64_t h = mix(0xcbf29ce484222325ull, seed);
+    uint64_t length = 0;
+    while (file) {
+        file.read(buffer.data(), (std::streamsize)buffer.size());
+        size_t n = (size_t)file.gcount();
+        length += n;
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, buffer.data() + i, 8);
+            h = mix(h, word);
+        }
+        if (i < n) {
+            uint64_t word = 0;
+            std::memcpy(&word, buffer.data() + i, n - i);
+            h = mix(h, word);
+        }
+    }
+    h = mix(h, length);
+    // 0 is reserved for "no key"
+    return h ? h : 1;
+}
+
+static size_t padding(size_t offset) {
+    return (kMeshCacheAlignment - offset % kMeshCacheAlignment) %
+           kMeshCacheAlignment;
+}
+
+bool WriteMeshCache(
+    const std::string &path, const MeshCacheHeader &header,
+    const std::vector<std::pair<const void *, size_t>> &sections) {
+    // unique per writer, so processes caching the same model do not write
+    // into each other's file
+    std::random_device random;
+    uint64_t nonce = mix(mix(random(), random()),
+                         (uint64_t)std::chrono::steady_clock::now()
+                             .time_since_epoch()
+                             .count());
+    std::string tmp = path + "." + std::to_string(nonce) + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        if (!file)
+            return false;
+        static const char zeros[kMeshCacheAlignment] = {};
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        size_t offset = sizeof(header);
+        for (const auto &[data, bytes] : sections) {
+            size_t pad = padding(offset);
+            file.write(zeros, (std::streamsize)pad);
+            file.write(static_cast<const char *>(data),
+                       (std::streamsize)bytes);
+            offset += pad + bytes;
+        }
+        if (!file) {
+            file.close();
+            std::remove(tmp.c_str());
+            return false;
+        }
+    }
+    // Replaces an existing cache atomically where rename can (POSIX). Where
+    // it can not, some other writer got there first and its cache is as
+    // good as ours; removing it first would leave readers without one.
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+MeshCacheReader::MeshCacheReader(const std::string &path, uint64_t key)
+    : file(path, std::ios::binary) {
+    if (!file)
+        return;
+    MeshCacheHeader expected;
+    file.read(reinterpret_cast<char *>(&head), sizeof(head));
+    ok = file && std::memcmp(head.magic, expected.magic, 8) == 0 &&
+         head.version == kMeshCacheVersion &&
+         head.headerSize == sizeof(MeshCacheHeader) && head.key == key;
+    if (ok) {
+        auto start = file.tellg();
+        file.seekg(0, std::ios::end);
+        fileSize = (uint64_t)file.tellg();
+        file.seekg(start);
+        ok = (bool)file;
+    }
+}
+
+bool MeshCacheReader::holds(const std::vector<uint64_t> &sections) const {
+    // sections are checked one by one, so huge counts can not overflow
+    uint64_t offset = sizeof(MeshCacheHeader);
+    for (uint64_t bytes : sections) {
+        offset += padding((size_t)offset);
+        if (offset > fileSize || bytes > fileSize - offset)
+            return false;
+        offset += bytes;
+    }
+    return true;
+}
+
+bool MeshCacheReader::read(void *dst, size_t bytes) {
+    if (!ok)
+        return false;
+    file.seekg((std::streamoff)padding((size_t)file.tellg()), std::ios::cur);
+    file.read(static_cast<char *>(dst), (std::streamsize)bytes);
+    ok = file && (size_t)file.gcount() == bytes;
+    return ok;
+}
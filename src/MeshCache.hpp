@@ -0,0 +1,69 @@
+//
+// Binary cache of parsed meshes and their BVHs, stored next to the model.
+//
+
+#ifndef RAYTRACING_MESHCACHE_H
+#define RAYTRACING_MESHCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The file is a fixed header followed by raw arrays, each starting on a
+// kMeshCacheAlignment boundary, so it can be read with one bulk read per
+// array (or mapped) without any parsing. Everything is stored in native
+// byte order; the magic and version guard against foreign files.
+constexpr uint32_t kMeshCacheVersion = 1;
+constexpr size_t kMeshCacheAlignment = 64;
+
+struct MeshCacheHeader {
+    char magic[8] = {'R', 'T', 'M', 'E', 'S', 'H', 'C', '\0'};
+    uint32_t version = kMeshCacheVersion;
+    uint32_t headerSize = sizeof(MeshCacheHeader);
+    // hash of the source model and the build parameters
+    uint64_t key = 0;
+    uint32_t numVertices = 0;
+    uint32_t numTriangles = 0;
+    uint32_t numNodes = 0;
+    float area = 0;
+    float boundsMin[3] = {};
+    float boundsMax[3] = {};
+};
+
+// Hash of the file content mixed with `seed`, which callers use to fold in
+// their build parameters. Returns 0 if the file can not be read.
+uint64_t HashFileContent(const std::string &path, uint64_t seed);
+
+// Writes header and sections to `path` through a temporary file of its own,
+// so neither a concurrent reader nor a concurrent writer of the same cache
+// sees a partial file. Returns false on failure, also when another writer's
+// file could not be replaced; the cache is left alone then.
+bool WriteMeshCache(const std::string &path, const MeshCacheHeader &header,
+                    const std::vector<std::pair<const void *, size_t>> &sections);
+
+// Sequential reader for a file written by WriteMeshCache.
+class MeshCacheReader {
+  public:
+    // Opens the cache and checks that it belongs to `key`.
+    MeshCacheReader(const std::string &path, uint64_t key);
+
+    [[nodiscard]] bool valid() const { return ok; }
+    [[nodiscard]] const MeshCacheHeader &header() const { return head; }
+    // Whether the file is large enough for sections of these sizes after
+    // the header. Check before allocating from header counts, so a corrupt
+    // or truncated file is rejected instead of asking for huge buffers.
+    [[nodiscard]] bool holds(const std::vector<uint64_t> &sections) const;
+    // Reads the next section into dst, which must hold `bytes` bytes.
+    bool read(void *dst, size_t bytes);
+
+  private:
+    std::ifstream file;
+    MeshCacheHeader head;
+    uint64_t fileSize = 0;
+    bool ok = false;
+};
+
+#endif // RAYTRACING_MESHCACHE_H
@@ -9,16 +9,49 @@
 #include "Bounds3.hpp"
 #include "Ray.hpp"
 #include "Intersection.hpp"
+#include "Transform.hpp"
 
 class Object
 {
 public:
     Object() = default;
     virtual ~Object() = default;
-    virtual Intersection getIntersection(Ray _ray) const = 0;
+    // Closest hit inside [ray.t_min, tMax). On a hit tMax shrinks to its
+    // distance and isect records it, otherwise both are left alone, so a
+    // caller testing several objects keeps passing the same pair and
+    // objects behind the closest hit so far are rejected early.
+    virtual bool getIntersection(const Ray &ray, float &tMax,
+                                 Intersection &isect) const = 0;
+    // Completes a hit recorded by getIntersection with the same ray:
+    // coords, normal and material.
+    virtual void getSurfaceProperties(const Ray &ray,
+                                      Intersection &isect) const = 0;
+    // Any-hit test against the segment [ray.t_min, ray.t_max], used for
+    // visibility where only "blocked or not" matters.
+    virtual bool IntersectP(const Ray &ray) const = 0;
     virtual Bounds3 getBounds() const=0;
+    // Bounds of the part of the object inside `box`, used by spatial BVH
+    // splits. Clipping the bounds is always valid, shapes that can do
+    // better override it.
+    virtual Bounds3 clipBounds(const Bounds3 &box) const {
+        return getBounds().Intersect(box);
+    }
     virtual float getArea() const=0;
+    // Area of the object placed by toWorld. The default scales getArea()
+    // by the transform's area factor, which is exact for rotations,
+    // translations and uniform scales; shapes that can sum up their exact
+    // transformed area override it.
+    virtual float getTransformedArea(const Transform &toWorld) const {
+        return getArea() *
+               std::pow(std::abs(toWorld.Determinant()), 2.f / 3.f);
+    }
     virtual void Sample(Intersection &pos, float &pdf) const=0;
+    // Area density Sample() reports for the point pos on the object, which
+    // MIS needs for points found by other means. The default is uniform
+    // over the area.
+    virtual float samplePdf(const Intersection &) const {
+        return 1.0f / getArea();
+    }
     virtual bool hasEmit() const =0;
 };
 
@@ -1,15 +1,20 @@
 #include <chrono>
 #include <functional>
 #include <iostream>
+#include <string>
 #include <type_traits>
 #include <utility>
 
 
 class RAIIProfiler {
   public:
-    RAIIProfiler() { start = std::chrono::system_clock::now(); }
+    explicit RAIIProfiler(std::string name = "") : name(std::move(name)) {
+        start = std::chrono::system_clock::now();
+    }
     ~RAIIProfiler() {
         auto duration = std::chrono::system_clock::now() - start;
+        if (!name.empty())
+            std::cout << name << ": ";
         std::cout << "Time taken: "
                   << std::chrono::duration_cast<std::chrono::minutes>(duration)
                          .count()
@@ -24,6 +29,7 @@ class RAIIProfiler {
     }
 
   private:
+    std::string name;
     std::chrono::system_clock::time_point start;
 };
 
@@ -5,27 +5,32 @@
 #ifndef RAYTRACING_RAY_H
 #define RAYTRACING_RAY_H
 #include "Vector.hpp"
+// Float only, like the traversal that consumes it: 48 bytes, passed by
+// reference down to the primitives.
 struct Ray{
     //Destination = origin + t*direction
     Vector3f origin;
     Vector3f direction, direction_inv;
-    double t;//transportation time,
-    double t_min, t_max;
+    float t_min, t_max;
+    // Set on rays mapped into the object space of a mirroring instance. The
+    // mirror reverses the winding of the faces, so such a ray hits the faces
+    // whose winding marks them as back facing, and culls the others.
+    bool mirrored = false;
 
-    Ray(const Vector3f& ori, const Vector3f& dir, const double _t = 0.0): origin(ori), direction(dir),t(_t) {
+    Ray(const Vector3f& ori, const Vector3f& dir): origin(ori), direction(dir) {
         direction_inv = Vector3f(1.f/direction.x, 1.f/direction.y, 1.f/direction.z);
-        t_min = 0.0;
-        t_max = std::numeric_limits<double>::max();
+        t_min = 0.f;
+        t_max = std::numeric_limits<float>::max();
     }
 
-    Vector3f operator()(double t) const{return origin+direction*t;}
+    Vector3f operator()(float t) const{return origin+direction*t;}
 
     bool operator == (const Ray& r) const{
         return origin == r.origin && direction == r.direction;
     }
 
     friend std::ostream &operator<<(std::ostream& os, const Ray& r){
-        os<<"[origin:="<<r.origin<<", direction="<<r.direction<<", time="<< r.t<<"]\n";
+        os<<"[origin:="<<r.origin<<", direction="<<r.direction<<"]\n";
         return os;
     }
 };
@@ -2,25 +2,29 @@
 // Created by goksu on 2/25/20.
 //
 
-#include <array>
-#include <fstream>
-#include <future>
-#include <thread>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
 #include <vector>
 
 #include "Profiler.h"
 #include "Renderer.hpp"
 #include "Scene.hpp"
+#include "TileScheduler.hpp"
 
 inline float deg2rad(const float &deg) { return deg * M_PI / 180.0f; }
 
-constexpr int kSPP = 128;
-constexpr int kBatchSize = 8;
+// Edge length in pixels of the square tiles the workers take the image in.
+constexpr int kTileSize = 16;
+
+inline float luminance(const Vector3f &color) {
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
 
 constexpr float EPSILON = 0.00001;
 // const float EPSILON = 0.0001;
 
-// save framebuffer to file
 void saveFramebuffer(const std::string &file, size_t width, size_t height,
                      const std::vector<Vector3f> &framebuffer) {
 
@@ -40,165 +44,240 @@ void saveFramebuffer(const std::string &file, size_t width, size_t height,
     fclose(fp);
 }
 
-void Renderer::RenderMain(Scene const *scene, const float scale,
-                          const float imageAspectRatio,
-                          const Vector3f &eye_pos) {
-    // std::cout << "start render thread " << std::this_thread::get_id()
-    //           << std::endl;
-    std::array<Vector3f, 1024> resColorBuf;
-    size_t m = 0;
-    for (uint32_t j = 0; j < scene->height; ++j) {
-        for (uint32_t i = 0; i < scene->width; ++i) {
+Renderer::Renderer(const RenderOptions &options)
+    : m_options(options), m_pool(options.threads) {
+    m_options.spp = std::max(m_options.spp, 1);
+    m_options.batchSize = std::clamp(m_options.batchSize, 1, m_options.spp);
+    m_options.threads = m_pool.size();
+    m_options.adaptive = m_options.adaptive && m_options.errorThreshold > 0;
+    m_options.sampleBudget = std::max(m_options.sampleBudget, 0.f);
+}
+
+Renderer::TileStats Renderer::RenderTile(const Scene &scene,
+                                         const RenderConfig &config, int tile,
+                                         int samples, float share,
+                                         const float scale,
+                                         const float imageAspectRatio,
+                                         const Vector3f &eye_pos,
+                                         std::vector<Vector3f> &frame) {
+    const int tilesX = (scene.width + kTileSize - 1) / kTileSize;
+    const int x0 = tile % tilesX * kTileSize, y0 = tile / tilesX * kTileSize;
+    const int x1 = std::min(x0 + kTileSize, scene.width);
+    const int y1 = std::min(y0 + kTileSize, scene.height);
+    TileStats stats;
+    for (int j = y0; j < y1; ++j) {
+        for (int i = x0; i < x1; ++i) {
+            if (m_cancel.load(std::memory_order_relaxed))
+                return stats;
             // generate primary ray direction
-            float x = (2 * (i + 0.5f) / (float)scene->width - 1) *
+            float x = (2 * (i + 0.5f) / (float)scene.width - 1) *
                       imageAspectRatio * scale;
-            float y = (1 - 2 * (j + 0.5f) / (float)scene->height) * scale;
+            float y = (1 - 2 * (j + 0.5f) / (float)scene.height) * scale;
             Vector3f dir = normalize(Vector3f(-x, y, 1));
-            Vector3f resColor(0.0f);
             Ray ray(eye_pos, dir);
-            for (int _ = 0; _ < kBatchSize; _++) {
-                resColor += scene->castRay(ray) / (float)kSPP;
+            size_t pixel = (size_t)j * scene.width + i;
+            Vector3f sum = m_sum[pixel];
+            float sumSquares = m_sumSquares[pixel];
+            int n = m_count[pixel];
+            int count = samples;
+            if (share > 0)
+                count += (int)std::ceil(share *
+                                        neededSamples(sum, sumSquares, n));
+            count = std::min(count, m_options.spp - n);
+            // Past the deadline the pixel only gets its mean written, so
+            // the image stays whole; the first sample of a pixel is still
+            // taken.
+            if (n > 0 && outOfTime())
+                count = 0;
+            for (int _ = 0; _ < count; _++) {
+                Vector3f color = scene.castRay(ray, config);
+                float l = luminance(color);
+                sum += color;
+                sumSquares += l * l;
             }
-            resColorBuf[i] = resColor;
-        }
-        {
-            auto lock = std::scoped_lock(m_framebufferMutex);
-            for (uint32_t i = 0; i < scene->width; ++i) {
-                m_framebuffer[m] += resColorBuf[i];
-                m += 1;
+            n += count;
+            m_sum[pixel] = sum;
+            m_sumSquares[pixel] = sumSquares;
+            m_count[pixel] = n;
+            // every pixel is written, skipped ones too: the back frame
+            // holds an image from two passes ago
+            frame[pixel] = sum / (float)n;
+            stats.samples += count;
+            if (!converged(sum, sumSquares, n)) {
+                ++stats.unconverged;
+                stats.needed += neededSamples(sum, sumSquares, n);
             }
         }
     }
+    return stats;
 }
 
-void Renderer::doRender(const Scene &scene) {
+bool Renderer::RenderPass(const Scene &scene) {
     const float scale = tanf(deg2rad(scene.fov * 0.5f));
     const float imageAspectRatio = (float)scene.width / (float)scene.height;
     const Vector3f eye_pos(278, 273, -800);
 
-    std::vector<std::thread> renderers = {};
-    for (int k = 0; k < kSPP; k += kBatchSize) {
-        renderers.emplace_back(&Renderer::RenderMain, this, &scene, scale,
-                               imageAspectRatio, eye_pos);
+    // One job per pool thread, each taking whole tiles; the scheduler
+    // moves tiles from busy workers to idle ones.
+    const int numTiles = ((scene.width + kTileSize - 1) / kTileSize) *
+                         ((scene.height + kTileSize - 1) / kTileSize);
+    const long long pixels = (long long)m_sum.size();
+    const long long budget = totalBudget();
+    int samples = 0;
+    float share = 0;
+    if (m_options.adaptive && m_samples >= kMinConvergenceSamples) {
+        // A pass costs about as many samples as a uniform one, handed out
+        // in proportion to what the unconverged pixels still need.
+        double passSamples = (double)pixels * m_options.batchSize;
+        if (budget > 0)
+            passSamples =
+                std::min(passSamples, (double)(budget - m_totalSamples));
+        share = (float)std::min(1.0, passSamples / m_needed);
+    } else {
+        samples = m_samples == 0 ? 1 : m_options.batchSize;
+        samples = std::min(samples, m_options.spp - m_samples);
+        if (budget > 0)
+            samples = std::clamp(
+                (int)((budget - m_totalSamples) / pixels), 1, samples);
     }
 
-    for (auto &&th : renderers) {
-        th.join();
+    // The workers only read this copy, never the scene's settings, which
+    // the caller may change for the next pass.
+    const RenderConfig config = scene.config;
+    std::vector<Vector3f> &frame = m_frames.back();
+    std::vector<TileStats> workerStats(m_pool.size());
+    TileScheduler scheduler(numTiles, m_pool.size());
+    m_pool.run(m_pool.size(), [&](int worker) {
+        TileStats &total = workerStats[worker];
+        for (int tile; !Cancelled() && (tile = scheduler.next(worker)) >= 0;) {
+            TileStats stats =
+                RenderTile(scene, config, tile, samples, share, scale,
+                           imageAspectRatio, eye_pos, frame);
+            total.unconverged += stats.unconverged;
+            total.samples += stats.samples;
+            total.needed += stats.needed;
+        }
+    });
+    if (Cancelled())
+        return false;
+    m_samples += samples;
+    m_unconverged = 0;
+    m_needed = 0;
+    for (const TileStats &stats : workerStats) {
+        m_unconverged += stats.unconverged;
+        m_totalSamples += stats.samples;
+        m_needed += stats.needed;
     }
-    UpdateProgress(1.f);
-}
-
-void Renderer::WindowMain(const std::string &file, size_t width,
-                          size_t height) {
-    sf::Event event{};
-    while (m_window.isOpen()) {
-        while (m_window.pollEvent(event)) {
-            if (event.type == sf::Event::Closed ||
-                (event.type == sf::Event::KeyPressed &&
-                 event.key.code == sf::Keyboard::Escape)) {
-                m_window.close();
-                exit = true;
-                return;
-            }
+    m_frames.publish();
+    return true;
+}
 
-            if (event.type == sf::Event::KeyPressed) {
-                switch (event.key.code) {
-                case sf::Keyboard::Q:
-                    next_sample = SAMPLE::BRDF;
-                    std::cout << "next sample: BRDF" << std::endl;
-                    break;
-                case sf::Keyboard::W:
-                    next_sample = SAMPLE::MIS;
-                    std::cout << "next sample: MIS" << std::endl;
-                    break;
-                case sf::Keyboard::E:
-                    next_sample = SAMPLE::LIGHT;
-                    std::cout << "next sample: LIGHT" << std::endl;
-                    break;
-                case sf::Keyboard::Up:
-                    next_rate = std::min(next_rate + 0.05f, 1.f);
-                    std::cout << "next rate: " << next_rate << std::endl;
-                    break;
-                case sf::Keyboard::Down:
-                    next_rate = std::max(next_rate - 0.05f, 0.f);
-                    std::cout << "next rate: " << next_rate << std::endl;
-                    break;
-                case sf::Keyboard::S:
-                    next_save = !next_save;
-                    break;
-                default:
-                    break;
-                }
-            }
-        }
+void Renderer::Reset(const Scene &scene) {
+    const size_t size = (size_t)scene.width * scene.height;
+    m_sum.assign(size, Vector3f());
+    m_sumSquares.assign(size, 0.f);
+    m_count.assign(size, 0);
+    m_samples = 0;
+    m_totalSamples = 0;
+    m_unconverged = (int)size;
+    m_needed = 0;
+    m_cancel = false;
+    // Every pass writes every pixel, so the published images only need
+    // the right size, and they keep it while a reader may be looking.
+    if (m_sizedFrames != size) {
+        m_frames.reset(std::vector<Vector3f>(size));
+        m_sizedFrames = size;
+    }
+    m_start = std::chrono::steady_clock::now();
+}
 
-        if (next_save) {
-            std::cout << "file save to : " << file << std::endl;
+bool Renderer::Finished() const {
+    if (m_samples >= m_options.spp)
+        return true;
+    const long long budget = totalBudget();
+    if (budget > 0 && m_totalSamples >= budget)
+        return true;
+    if (outOfTime())
+        return true;
+    if (m_options.errorThreshold <= 0 || m_samples < kMinConvergenceSamples)
+        return false;
+    // Adaptively sampled pixels may also stop at their spp cap unconverged.
+    return m_unconverged == 0 || (m_options.adaptive && m_needed <= 0);
+}
 
-            saveFramebuffer(file, width, height, m_framebuffer_copy);
-            next_save = false;
-        }
-        std::vector<sf::Color> colors;
-        colors.resize(m_framebuffer_copy.size());
-        size_t m = 0;
-        for (uint32_t i = 0; i < width; ++i) {
-            for (uint32_t j = 0; j < height; ++j) {
-                const Vector3f color =
-                    Vector3f::Min(m_framebuffer_copy[m], Vector3f{1, 1, 1});
-                colors[j * width + i] = sf::Color(255 * color.x, 255 * color.y,
-                                        255 * color.z);
-                m += 1;
-            }
-        }
-        m_screen.fillPixel(colors);
-        m_window.draw(m_screen);
-        m_window.display();
+float Renderer::Samples() const {
+    return m_sum.empty() ? 0.f : (float)m_totalSamples / m_sum.size();
+}
 
-        std::this_thread::sleep_for(std::chrono::microseconds(17));
-    }
+float Renderer::Progress() const {
+    if (m_sum.empty())
+        return 0;
+    const float pixels = (float)m_sum.size();
+    long long budget = totalBudget();
+    if (budget <= 0)
+        budget = (long long)m_options.spp * m_sum.size();
+    float progress = (float)m_totalSamples / budget;
+    if (m_options.errorThreshold > 0)
+        progress = std::max(progress, 1 - m_unconverged / pixels);
+    if (m_options.timeBudget > 0)
+        progress = std::max(progress, elapsed() / m_options.timeBudget);
+    return std::min(progress, 1.f);
 }
 
-// The main render function. This where we iterate over all pixels in the
-// image, generate primary rays and cast these rays into the scene. The
-// content of the framebuffer is saved to a file.
-void Renderer::Render(Scene &scene, const std::string &file) {
-    m_window.create(sf::VideoMode(scene.width, scene.height), "Render",
-                    sf::Style::Titlebar | sf::Style::Close);
-    m_window.setVerticalSyncEnabled(true);
-    m_screen.create(scene.width, scene.height, 1.f, sf::Color::White);
-    const size_t framebufferSize = scene.width * scene.height;
-    m_framebuffer.resize(framebufferSize);
-    m_framebuffer_copy.resize(framebufferSize);
-    next_rate = scene.mis_rate;
-    next_sample = scene.sample;
-
-    // change the spp value to change sample amount
-    std::cout << "SPP: " << kSPP << "\n";
-    std::thread th = std::thread([&scene, this, framebufferSize]() {
-        while (!exit) {
-            {
-                RAIIProfiler profiler;
-                this->doRender(scene);
-                std::cout << "\n";
-            }
+long long Renderer::totalBudget() const {
+    return (long long)(m_options.sampleBudget * m_sum.size());
+}
 
-            {
-                auto lock = std::scoped_lock(m_framebufferMutex);
-                m_framebuffer_copy = m_framebuffer;
-                m_framebuffer.clear();
-                m_framebuffer.resize(framebufferSize);
-            }
+float Renderer::elapsed() const {
+    return std::chrono::duration<float>(std::chrono::steady_clock::now() -
+                                        m_start)
+        .count();
+}
 
-            while (!exit && !scene.UpdateRenderConfig(next_sample, next_rate)) {
-                std::this_thread::yield();
-            }
-            if (!exit) {
-                std::cout << "Update sample: " << next_sample
-                          << " rate: " << next_rate << "\n";
-            }
-        }
-    });
+bool Renderer::outOfTime() const {
+    return m_options.timeBudget > 0 && elapsed() >= m_options.timeBudget;
+}
+
+float Renderer::errorRatio(const Vector3f &sum, float sumSquares,
+                           int n) const {
+    // standard error of the mean luminance, from the sample variance
+    float mean = luminance(sum) / n;
+    float variance = std::max(0.f, (sumSquares - n * mean * mean) / (n - 1));
+    float error = std::sqrt(variance / n);
+    return error / (m_options.errorThreshold * std::max(mean, kMinLuminance));
+}
+
+bool Renderer::converged(const Vector3f &sum, float sumSquares, int n) const {
+    return m_options.errorThreshold > 0 && n >= kMinConvergenceSamples &&
+           errorRatio(sum, sumSquares, n) <= 1;
+}
+
+float Renderer::neededSamples(const Vector3f &sum, float sumSquares,
+                              int n) const {
+    const int room = m_options.spp - n;
+    if (n < kMinConvergenceSamples)
+        return (float)room;
+    if (converged(sum, sumSquares, n))
+        return 0;
+    // The standard error falls with the square root of the sample count.
+    float ratio = errorRatio(sum, sumSquares, n);
+    return std::min((float)room, n * (ratio * ratio - 1));
+}
 
-    WindowMain(file, scene.width, scene.height);
-    th.join();
+void Renderer::RenderToFile(const Scene &scene, const std::string &file) {
+    Reset(scene);
+    std::cout << "SPP: " << m_options.spp << "\n";
+    {
+        RAIIProfiler profiler;
+        while (!Finished() && RenderPass(scene))
+            UpdateProgress(Progress());
+        std::cout << "\n";
+    }
+    std::cout << "samples per pixel: " << Samples();
+    if (m_options.errorThreshold > 0)
+        std::cout << ", unconverged pixels: " << m_unconverged;
+    std::cout << "\n";
+    AcquireFrame();
+    saveFramebuffer(file, scene.width, scene.height, Frame());
+    std::cout << "file save to : " << file << std::endl;
 }
@@ -2,37 +2,161 @@
 // Created by goksu on 2/25/20.
 //
 
-#ifndef RENDERER_H 
+#ifndef RENDERER_H
 #define RENDERER_H
 
-#include <SFML/Graphics.hpp>
-#include <mutex>
+#include <atomic>
+#include <chrono>
 #include <string>
+#include <vector>
 
 #include "Scene.hpp"
-#include "VirtualScreen.hpp"
+#include "ThreadPool.hpp"
+#include "TripleBuffer.hpp"
 
+// Writes framebuffer as a binary PPM, gamma corrected.
+void saveFramebuffer(const std::string &file, size_t width, size_t height,
+                     const std::vector<Vector3f> &framebuffer);
+
+// How a Renderer splits up its work and when it stops. The image itself
+// (resolution, path depth, sampling) is configured on the Scene.
+struct RenderOptions {
+    // samples per pixel of a finished image; with adaptive sampling the
+    // most any one pixel gets
+    int spp = 128;
+    // Samples per pixel a worker renders a tile with before it takes the
+    // next one, and so the samples each pass adds to the image. Larger
+    // batches mean fewer passes, smaller ones finer grained balancing and
+    // earlier first images.
+    int batchSize = 8;
+    // worker threads, 0 for one per hardware thread
+    int threads = 0;
+    // An image is also finished after timeBudget seconds, or once the
+    // standard error of every pixel is below errorThreshold times its
+    // brightness; 0 turns either off. The time budget also stops the pass
+    // in flight, which takes no more samples once it runs out, except for
+    // pixels that have none yet.
+    float timeBudget = 0;
+    float errorThreshold = 0;
+    // Spend the samples of a pass where the error is highest instead of
+    // evenly: after a few uniform passes, pixels that met errorThreshold
+    // get no more samples and the others a share of the pass that grows
+    // with their estimated remaining samples. Needs errorThreshold.
+    bool adaptive = false;
+    // Most samples per pixel, averaged over the image, an image may take
+    // in total; 0 for no limit beyond spp.
+    float sampleBudget = 0;
+};
+
+// Renders images progressively on a pool of worker threads: every pass adds
+// batchSize samples per pixel to running sums, and publishes the refined
+// image, until one of the stopping criteria of the options is met. Has no
+// window of its own: RenderToFile is the batch mode, an interactive front
+// end (see Viewer) drives the passes and shows the published images.
 class Renderer {
   public:
-    void Render(Scene &scene, const std::string &file = "binary.ppm");
+    explicit Renderer(const RenderOptions &options = {});
+    [[nodiscard]] const RenderOptions &Options() const { return m_options; }
+
+    // Renders an image until it is finished and writes it to file.
+    void RenderToFile(const Scene &scene,
+                      const std::string &file = "binary.ppm");
+
+    // Starts a new image of scene, dropping the samples so far, and clears
+    // a cancel. Call before the first pass; changing the resolution must
+    // not race with a reader.
+    void Reset(const Scene &scene);
+    // Adds one pass, sampled with the scene's RenderConfig as it is when
+    // the pass starts, to the image and publishes it. The first pass of an
+    // image takes one sample per pixel, to show something quickly. Returns
+    // false, publishing nothing, if the pass was cancelled.
+    bool RenderPass(const Scene &scene);
+    // Makes the pass in flight, if any, and all later ones return early
+    // until the next Reset; the image is left half updated. Safe to call
+    // from any thread.
+    void Cancel() { m_cancel = true; }
+    [[nodiscard]] bool Cancelled() const { return m_cancel; }
+    // True once the image met a stopping criterion.
+    [[nodiscard]] bool Finished() const;
+    // samples per pixel so far, averaged over the image
+    [[nodiscard]] float Samples() const;
+    // rough fraction of the image done, for progress bars
+    [[nodiscard]] float Progress() const;
+    // pixels above the error threshold after the last pass
+    [[nodiscard]] int UnconvergedPixels() const { return m_unconverged; }
+
+    // Reader side of the published images: AcquireFrame moves the latest
+    // one, if any, to Frame(), which stays valid until the next call. May
+    // run on another thread than RenderPass.
+    bool AcquireFrame() { return m_frames.acquire(); }
+    [[nodiscard]] const std::vector<Vector3f> &Frame() const {
+        return m_frames.front();
+    }
 
   private:
-    void doRender(const Scene &scene);
-    void WindowMain(const std::string &file, size_t width, size_t height);
-    void RenderMain(Scene const *scene, const float scale,
-                    const float imageAspectRatio, const Vector3f &eye_pos);
-
-    std::vector<Vector3f> m_framebuffer;
-    std::vector<Vector3f> m_framebuffer_copy;
-    sf::RenderWindow m_window;
-    VirtualScreen m_screen;
-    std::mutex m_framebufferMutex;
-
-    // Keyboard control.
-    std::atomic<bool> exit = false;
-    SAMPLE next_sample;
-    float next_rate;
-    bool next_save = false;
+    struct TileStats {
+        int unconverged = 0;
+        // samples rendered, and estimated samples still needed to
+        // converge the pixels
+        long long samples = 0;
+        double needed = 0;
+    };
+    // Adds `samples` samples to every pixel of one tile, plus `share` of
+    // its estimated needed samples, stores the new means in frame and
+    // returns the tile's stats afterwards.
+    TileStats RenderTile(const Scene &scene, const RenderConfig &config,
+                         int tile, int samples, float share, const float scale,
+                         const float imageAspectRatio, const Vector3f &eye_pos,
+                         std::vector<Vector3f> &frame);
+    // Standard error of the mean luminance of a pixel with these sums
+    // over n samples, relative to what the error threshold allows it.
+    [[nodiscard]] float errorRatio(const Vector3f &sum, float sumSquares,
+                                   int n) const;
+    // Whether such a pixel meets the error threshold.
+    [[nodiscard]] bool converged(const Vector3f &sum, float sumSquares,
+                                 int n) const;
+    // Samples the pixel likely still needs to meet the error threshold,
+    // within its spp cap.
+    [[nodiscard]] float neededSamples(const Vector3f &sum, float sumSquares,
+                                      int n) const;
+    // sampleBudget in samples, 0 for none
+    [[nodiscard]] long long totalBudget() const;
+    // seconds since the image was started
+    [[nodiscard]] float elapsed() const;
+    // whether the time budget, if any, ran out
+    [[nodiscard]] bool outOfTime() const;
+
+    // The error estimate needs enough samples to have seen the rare bright
+    // paths of a pixel, so adaptive sampling starts with this many uniform
+    // ones; with 16 too many noisy pixels stopped early.
+    static constexpr int kMinConvergenceSamples = 32;
+    // Dark pixels are held to the error of this brightness instead; their
+    // relative error is invisible in the image.
+    static constexpr float kMinLuminance = 0.05f;
+
+    RenderOptions m_options;
+
+    // Per pixel running sums of the samples and of their squared
+    // luminance, the latter for the error estimate, and the sample counts.
+    // Tiles do not overlap, so each pixel has exactly one writer during a
+    // pass.
+    std::vector<Vector3f> m_sum;
+    std::vector<float> m_sumSquares;
+    std::vector<int> m_count;
+    // samples every pixel has, from the uniform passes
+    int m_samples = 0;
+    long long m_totalSamples = 0;
+    int m_unconverged = 0;
+    double m_needed = 0;
+    std::chrono::steady_clock::time_point m_start;
+    std::atomic<bool> m_cancel = false;
+
+    // Finished passes go from the rendering thread to the reader through
+    // here; the workers fill the back frame, the reader sees the front.
+    TripleBuffer<std::vector<Vector3f>> m_frames;
+    size_t m_sizedFrames = 0;
+    // render workers, kept across images and sample mode switches
+    ThreadPool m_pool;
 };
 
 #endif // RENDERER_H
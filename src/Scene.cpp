@@ -4,14 +4,23 @@
 
 #include "Scene.hpp"
 
+#include <cassert>
 #include <memory>
 #include <cmath>
 
-#include "Sphere.hpp"
-
 void Scene::buildBVH() {
     std::cout << " - Generating BVH...\n\n";
-    this->bvh.reset(new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE));
+    this->bvh.reset(new BVHAccel(objects, 1, bvhSplit, bvhLayout));
+}
+
+void Scene::refitBVH() {
+    this->bvh->refit();
+    // 光源的面积可能随变换改变
+    emit_area_sum_cache = 0.f;
+    for (const auto &object : objects) {
+        if (object->hasEmit())
+            emit_area_sum_cache += object->getArea();
+    }
 }
 
 Intersection Scene::intersect(const Ray &ray) const
@@ -19,6 +28,20 @@ Intersection Scene::intersect(const Ray &ray) const
     return this->bvh->Intersect(ray);
 }
 
+bool Scene::occluded(const Vector3f &p, const Vector3f &x) const
+{
+    // a little offset on both ends, so neither the surface at p nor the
+    // light surface at x counts as a blocker
+    static constexpr float kShadowOffset = 0.01f;
+    static constexpr float kShadowTolerance = 0.005f;
+    Vector3f d = x - p;
+    float dist = d.norm();
+    Vector3f ws = d / dist;
+    Ray ray(p + ws * kShadowOffset, ws);
+    ray.t_max = dist - kShadowOffset - kShadowTolerance;
+    return ray.t_max > 0 && this->bvh->IntersectP(ray);
+}
+
 void Scene::initLight(){
     // for(auto&& object: objects){
     //     if(object->hasEmit()){
@@ -70,20 +93,16 @@ float misWeight(float pdfA,float pdfB) {
     return misWeightPower(pdfA,pdfB);
 }
 
-// pdf of light
-// only support sphere light
-float sphericalLightSamplingPdf(const Vector3f x,const Sphere* sphere){
-    float solidangle = NAN ;
-    Vector3f w = sphere->getCenter() - x;
-    float dc_2 = dotProduct(w,w);
-    if(dc_2 > sphere->getRadius2()){
-        float sin_theta_max_2 = clamp(sphere->getRadius2()/dc_2,0.0,1.0);
-        float cos_theta_max = sqrtf(1.0f - sin_theta_max_2);
-        solidangle = M_PI*2 * (1.0 - cos_theta_max);
-    }else{
-        solidangle = M_PI*4;
-    }
-    return 1.0f / solidangle;
+// Density, per solid angle at p, with which sampleLight picks the point x
+// on a light, for weighing it against the BRDF sample of the same
+// direction. Lights only emit from their front side.
+float lightSolidAnglePdf(const Vector3f &p, const Intersection &x) {
+    Vector3f d = x.coords - p;
+    float dist2 = dotProduct(d, d);
+    float cos_l = -dotProduct(x.normal, d) / std::sqrt(dist2);
+    if (cos_l <= 0.0f)
+        return 0.0f;
+    return x.obj->samplePdf(x) * dist2 / cos_l;
 }
 
 // unused
@@ -107,12 +126,13 @@ float Scene::lightChoosingPdf(Vector3f x,int light)const {
  * TODO: Why this function is brighter than shadeLight?
  * sample to BRDF
  * @param ray       光线
+ * @param config    本次渲染的采样设置
  * @param depth     递归的深度
  * @param useMis    是否是MIS
  * @return
  */
-Vector3f Scene::shadeBRDF(const Ray& ray,Intersection hit_result, int depth,bool useMis)const{
-    if (depth > max_depth)
+Vector3f Scene::shadeBRDF(const Ray& ray,const Intersection& hit_result, const RenderConfig& config, int depth,bool useMis)const{
+    if (depth > config.max_depth)
         return backgroundColor;
 
     assert(hit_result.happened);
@@ -125,7 +145,7 @@ Vector3f Scene::shadeBRDF(const Ray& ray,Intersection hit_result, int depth,bool
     const Material* m = hit_result.m;
 
     // RR test
-    if (get_random_float() > RussianRoulette) {
+    if (get_random_float() > config.RussianRoulette) {
         return Lo;
     }
 
@@ -150,20 +170,15 @@ Vector3f Scene::shadeBRDF(const Ray& ray,Intersection hit_result, int depth,bool
     if (hit.happened) {
         // 击中光源
         if (hitm->hasEmission()) {
-            if (useMis) {
-                // 必须是球光源
-                float lightPdf = sphericalLightSamplingPdf(hit.coords, dynamic_cast<const Sphere *>(hit.obj));
-                weight = misWeight(pdf, lightPdf);
-            }
+            if (useMis)
+                weight = misWeight(pdf, lightSolidAnglePdf(p, hit));
             Lo = hitm->getEmission();
         } else {
-            // 射出下一条光线
-            if (useMis)
-                weight = misWeight(pdf, (1.0 / (2 * M_PI)));
-            Lo = shadeBRDF(next_ray, hit, depth + 1, useMis);
+            // 射出下一条光线; MIS only weighs the last bounce onto a light
+            Lo = shadeBRDF(next_ray, hit, config, depth + 1, useMis);
         }
         Vector3f fr = m->eval(wo,wi,N);
-        Lo = Lo * fr * cos_a * RR_inv * (1.0f / pdf);
+        Lo = Lo * fr * cos_a * (1.0f / (pdf * config.RussianRoulette));
         return Lo * weight;
     } else {
         // Not hit light, return empty color.
@@ -173,12 +188,13 @@ Vector3f Scene::shadeBRDF(const Ray& ray,Intersection hit_result, int depth,bool
 /**
  * sample to the light
  * @param ray
+ * @param config
  * @param depth
  * @param useMis
  * @return
  */
-Vector3f Scene::shadeLight(const Ray& ray,Intersection hit_result, int depth,bool useMis) const {
-    if (depth > max_depth)
+Vector3f Scene::shadeLight(const Ray& ray,const Intersection& hit_result, const RenderConfig& config, int depth,bool useMis) const {
+    if (depth > config.max_depth)
         return backgroundColor;
     assert(hit_result.happened);
     float weight = 1.0f;
@@ -196,25 +212,24 @@ Vector3f Scene::shadeLight(const Ray& ray,Intersection hit_result, int depth,boo
         sampleLight(lightSample, pdf);
         Vector3f x = lightSample.coords;
         Vector3f ws = (x - p).normalized();
-        Intersection hit = intersect(Ray(p + ws * 0.01f, ws));
         float cos_a = dotProduct(ws, N);
-        // 中间没有阻挡
-        if (hit.coords == x && cos_a > 0.0f && pdf > EPSILON) {
-            Vector3f NN = lightSample.normal;
-            L_dir = lightSample.emit * m->eval(wo, ws, N) * cos_a * dotProduct(-ws, NN);
+        Vector3f NN = lightSample.normal;
+        // 光源正面朝向p, 且中间没有阻挡
+        if (cos_a > 0.0f && pdf > EPSILON && dotProduct(-ws, NN) > 0.0f &&
+            !occluded(p, x)) {
+            L_dir = lightSample.m->getEmission() * m->eval(wo, ws, N) * cos_a * dotProduct(-ws, NN);
             float redundant = (x - p).norm();
             redundant *= redundant;
             redundant *= pdf;
 
-            if (useMis) {
-                float brdfPdf = m->pdf(wo, ws, N) / hit.obj->getArea();
-                weight = misWeight(pdf, brdfPdf);
-            }
+            if (useMis)
+                weight = misWeight(lightSolidAnglePdf(p, lightSample),
+                                   m->pdf(wo, ws, N));
             L_dir = L_dir * (1.0f / redundant) * weight;
         }
     }
     // 间接光照
-    if (get_random_float() <= RussianRoulette) {
+    if (get_random_float() <= config.RussianRoulette) {
         Vector3f wi = (m->sample(wo, N)).normalized();
         Ray next_ray = Ray(p + wi * 0.01f, wi);
         Intersection hit = intersect(next_ray);
@@ -223,15 +238,15 @@ Vector3f Scene::shadeLight(const Ray& ray,Intersection hit_result, int depth,boo
         float pdf = m->pdf(wo, wi, N);
         Vector3f fr = m->eval(wo, wi, N);
         if (hitMaterial != nullptr && !hitMaterial->hasEmission() && cos_a > 0.0f && pdf > EPSILON) {
-            L_indir = shadeLight(next_ray ,hit, depth + 1, useMis) * fr *
-                      cos_a * (1.0f / pdf) * RR_inv * weight;
+            L_indir = shadeLight(next_ray ,hit, config, depth + 1, useMis) * fr *
+                      cos_a * (1.0f / (pdf * config.RussianRoulette));
         }
     }
     return L_dir + L_indir;
 }
 
 // Implementation of Path Tracing
-Vector3f Scene::castRay(const Ray &ray) const {
+Vector3f Scene::castRay(const Ray &ray, const RenderConfig &config) const {
     Intersection intersection = intersect(ray);
     if(!intersection.happened)
         // 没有命中
@@ -243,16 +258,16 @@ Vector3f Scene::castRay(const Ray &ray) const {
     if (m->hasEmission()) {
         return m->getEmission();
     }
-    if (sample == MIS) {
-        Vector3f brdf = shadeBRDF(ray, intersection, 0, true);
-        Vector3f light = shadeLight(ray, intersection,0, true);
+    if (config.sample == MIS) {
+        Vector3f brdf = shadeBRDF(ray, intersection, config, 0, true);
+        Vector3f light = shadeLight(ray, intersection, config, 0, true);
         // float p = brdf.norm() > light.norm() ? 0.2 : 0.8;
         // return lerp(brdf, light, p);
-        // return lerp(brdf, light, mis_rate);
+        // return lerp(brdf, light, config.mis_rate);
         return brdf + light;
-    } else if (sample == LIGHT) {
-        return shadeLight(ray, intersection,0);
+    } else if (config.sample == LIGHT) {
+        return shadeLight(ray, intersection, config, 0);
     } else {
-        return shadeBRDF(ray, intersection, 0);
+        return shadeBRDF(ray, intersection, config, 0);
     }
 }
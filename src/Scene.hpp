@@ -14,11 +14,21 @@
 
 enum SAMPLE{MIS,LIGHT,BRDF};
 
-class Scene
+// How paths are sampled. The renderer copies these from the scene at the
+// start of every pass, so the workers see one fixed set for the whole pass
+// while the scene's copy changes between passes.
+struct RenderConfig
 {
+    SAMPLE sample = LIGHT;
+    float mis_rate = 0.5f;
+    // paths end after max_depth bounces, and before that with probability
+    // 1 - RussianRoulette at each bounce
     int max_depth = 105;
-    static constexpr float RussianRoulette = 0.8;
-    static constexpr float RR_inv = 1.f / RussianRoulette;
+    float RussianRoulette = 0.8f;
+};
+
+class Scene
+{
     Vector3f backgroundColor = Vector3f(0.01, 0.01, 0.01);
     std::vector<std::unique_ptr<Material>> materials;
 
@@ -29,16 +39,20 @@ public:
     double fov = 40;
     int width = 1280;
     int height = 960;
-    SAMPLE sample;
-    float mis_rate = 0.5f;
+    RenderConfig config;
+    // how buildBVH builds the scene BVH over the objects; refitBVH
+    // rebuilds a COMPRESSED scene BVH entirely
+    BVHAccel::SplitMethod bvhSplit = BVHAccel::SplitMethod::SAH;
+    BVHAccel::NodeLayout bvhLayout = BVHAccel::NodeLayout::WIDE;
 
-    Scene(int w, int h) : width(w), height(h),sample(LIGHT)
+    Scene(int w, int h) : width(w), height(h)
     {}
 
+    // Not while a pass renders; passes see the change from the next one on.
     bool UpdateRenderConfig(SAMPLE sample_, float mis_rate_) {
-        if (sample != sample_ || mis_rate != mis_rate_) {
-            sample = sample_;
-            mis_rate = mis_rate_;
+        if (config.sample != sample_ || config.mis_rate != mis_rate_) {
+            config.sample = sample_;
+            config.mis_rate = mis_rate_;
             return true;
         } else {
             return false;
@@ -52,9 +66,15 @@ public:
     // [[nodiscard]] const std::vector<std::unique_ptr<Object>>& get_objects() const { return objects; }
     [[nodiscard]] const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     [[nodiscard]] Intersection intersect(const Ray& ray) const;
+    // true if anything blocks the segment between p and x
+    [[nodiscard]] bool occluded(const Vector3f& p, const Vector3f& x) const;
     std::unique_ptr<BVHAccel> bvh;
     void buildBVH();
-    [[nodiscard]] Vector3f castRay(const Ray &ray) const;
+    // Call after objects moved or changed shape (Instance::setTransform,
+    // MeshTriangle::updateVertices) instead of buildBVH; refits the scene
+    // BVH and only rebuilds the parts that degraded.
+    void refitBVH();
+    [[nodiscard]] Vector3f castRay(const Ray &ray, const RenderConfig &config) const;
     void sampleLight(Intersection &pos, float &pdf) const;
 
     // creating the scene (adding objects and lights)
@@ -62,8 +82,8 @@ public:
     std::vector<std::unique_ptr<Light> > lights;
 
 
-    [[nodiscard]] Vector3f shadeBRDF(const Ray &ray,Intersection hit_result, int depth, bool useMis = false) const;
-    [[nodiscard]] Vector3f shadeLight(const Ray &ray,Intersection hit_result, int depth, bool useMis = false) const;
+    [[nodiscard]] Vector3f shadeBRDF(const Ray &ray,const Intersection& hit_result, const RenderConfig &config, int depth, bool useMis = false) const;
+    [[nodiscard]] Vector3f shadeLight(const Ray &ray,const Intersection& hit_result, const RenderConfig &config, int depth, bool useMis = false) const;
 
     [[nodiscard]] float lightChoosingPdf(Vector3f x,int light)const;
 
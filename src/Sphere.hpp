@@ -19,30 +19,48 @@ class Sphere : public Object {
   public:
     Sphere(const Vector3f &c, const float &r, Material *mt)
         : center(c), radius(r), radius2(r * r), m(mt), area(4 * M_PI * r * r) {}
-    Intersection getIntersection(Ray ray) const override {
-        Intersection result;
-        result.happened = false;
+    bool getIntersection(const Ray &ray, float &tMax,
+                         Intersection &isect) const override {
         Vector3f L = ray.origin - center;
         if (L.norm() < radius)
-            return result;
+            return false;
         float a = dotProduct(ray.direction, ray.direction);
         float b = 2 * dotProduct(ray.direction, L);
         float c = dotProduct(L, L) - radius2;
         float t0, t1;
         if (!solveQuadratic(a, b, c, t0, t1))
-            return result;
+            return false;
         if (t0 < 0)
             t0 = t1;
-        if (t0 < 0)
-            return result;
-        result.happened = true;
+        if (t0 < 0 || t0 < ray.t_min || t0 >= tMax)
+            return false;
+        tMax = t0;
+        isect.happened = true;
+        isect.obj = this;
+        isect.distance = t0;
+        return true;
+    }
+
+    void getSurfaceProperties(const Ray &ray,
+                              Intersection &isect) const override {
+        isect.coords = Vector3f(ray.origin + ray.direction * isect.distance);
+        isect.normal = normalize(Vector3f(isect.coords - center));
+        isect.m = this->m;
+    }
 
-        result.coords = Vector3f(ray.origin + ray.direction * t0);
-        result.normal = normalize(Vector3f(result.coords - center));
-        result.m = this->m;
-        result.obj = this;
-        result.distance = t0;
-        return result;
+    bool IntersectP(const Ray &ray) const override {
+        Vector3f L = ray.origin - center;
+        if (L.norm() < radius)
+            return false;
+        float a = dotProduct(ray.direction, ray.direction);
+        float b = 2 * dotProduct(ray.direction, L);
+        float c = dotProduct(L, L) - radius2;
+        float t0, t1;
+        if (!solveQuadratic(a, b, c, t0, t1))
+            return false;
+        if (t0 < 0)
+            t0 = t1;
+        return t0 >= 0 && t0 >= ray.t_min && t0 < ray.t_max;
     }
 
     Bounds3 getBounds() const override {
@@ -57,7 +75,8 @@ class Sphere : public Object {
                      std::sin(phi) * std::sin(theta));
         pos.coords = center + radius * dir;
         pos.normal = dir;
-        pos.emit = m->getEmission();
+        pos.m = m;
+        pos.obj = this;
         pdf = 1.0f / area;
     }
     float getArea() const override { return area; }
@@ -0,0 +1,54 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int numThreads) {
+    if (numThreads <= 0)
+        numThreads = (int)std::max(1u, std::thread::hardware_concurrency());
+    threads.reserve(numThreads);
+    for (int i = 0; i < numThreads; ++i)
+        threads.emplace_back(&ThreadPool::workerMain, this);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        auto lock = std::scoped_lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &&th : threads)
+        th.join();
+}
+
+void ThreadPool::run(int count, const std::function<void(int)> &fn) {
+    int remaining = count;
+    {
+        auto lock = std::scoped_lock(mutex);
+        for (int i = 0; i < count; ++i) {
+            jobs.emplace_back([this, &fn, &remaining, i] {
+                fn(i);
+                auto lock = std::scoped_lock(mutex);
+                if (--remaining == 0)
+                    done.notify_all();
+            });
+        }
+    }
+    wake.notify_all();
+    std::unique_lock lock(mutex);
+    done.wait(lock, [&] { return remaining == 0; });
+}
+
+void ThreadPool::workerMain() {
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock lock(mutex);
+            wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
@@ -0,0 +1,46 @@
+//
+// Long-lived worker threads fed from a job queue.
+//
+
+#ifndef RAYTRACING_THREADPOOL_H
+#define RAYTRACING_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads are started once and sleep on the queue between jobs, so a
+// render pass costs a wake-up instead of a thread start and join per
+// worker.
+class ThreadPool {
+  public:
+    // numThreads <= 0 uses one thread per hardware thread.
+    explicit ThreadPool(int numThreads = 0);
+    // Finishes the queued jobs, then joins the threads.
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    [[nodiscard]] int size() const { return (int)threads.size(); }
+
+    // Queues fn(0) ... fn(count - 1) and blocks until all of them returned.
+    // Must not be called from a job of the same pool.
+    void run(int count, const std::function<void(int)> &fn);
+
+  private:
+    void workerMain();
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    // signalled when jobs are queued or the pool shuts down
+    std::condition_variable wake;
+    // signalled when a job of a run() finished
+    std::condition_variable done;
+    std::deque<std::function<void()>> jobs;
+    bool stopping = false;
+};
+
+#endif // RAYTRACING_THREADPOOL_H
@@ -0,0 +1,56 @@
+#include "TileScheduler.hpp"
+
+#include <algorithm>
+
+TileScheduler::TileScheduler(int numTiles, int numWorkers)
+    : numWorkers(std::max(numWorkers, 1)),
+      blocks(new Block[std::max(numWorkers, 1)]) {
+    for (int w = 0; w < this->numWorkers; ++w) {
+        auto first = (uint32_t)((int64_t)numTiles * w / this->numWorkers);
+        auto last = (uint32_t)((int64_t)numTiles * (w + 1) / this->numWorkers);
+        blocks[w].range.store(pack(first, last), std::memory_order_relaxed);
+    }
+}
+
+int TileScheduler::next(int worker) {
+    std::atomic<uint64_t> &own = blocks[worker].range;
+    uint64_t range = own.load(std::memory_order_relaxed);
+    while (begin(range) < end(range)) {
+        if (own.compare_exchange_weak(range,
+                                      pack(begin(range) + 1, end(range)),
+                                      std::memory_order_relaxed))
+            return (int)begin(range);
+    }
+    return steal(worker);
+}
+
+int TileScheduler::steal(int worker) {
+    for (;;) {
+        // the largest block, so one steal moves as much work as possible
+        int victim = -1;
+        uint64_t victimRange = 0;
+        uint32_t most = 0;
+        for (int i = 1; i < numWorkers; ++i) {
+            int w = (worker + i) % numWorkers;
+            uint64_t range = blocks[w].range.load(std::memory_order_relaxed);
+            if (begin(range) < end(range) && end(range) - begin(range) > most) {
+                victim = w;
+                victimRange = range;
+                most = end(range) - begin(range);
+            }
+        }
+        if (victim < 0)
+            return -1;
+
+        uint32_t mid = begin(victimRange) + most / 2;
+        if (!blocks[victim].range.compare_exchange_strong(
+                victimRange, pack(begin(victimRange), mid),
+                std::memory_order_relaxed))
+            continue;
+        // Only the owner stores into its empty block, thieves leave empty
+        // blocks alone.
+        blocks[worker].range.store(pack(mid + 1, end(victimRange)),
+                                   std::memory_order_relaxed);
+        return (int)mid;
+    }
+}
@@ -0,0 +1,44 @@
+//
+// Work-stealing distribution of image tiles over render workers.
+//
+
+#ifndef RAYTRACING_TILESCHEDULER_H
+#define RAYTRACING_TILESCHEDULER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Hands out tiles [0, numTiles) exactly once among numWorkers workers. Each
+// worker starts on its own contiguous block of tiles, so neighbouring tiles
+// (and the geometry they see) stay on one core. A worker whose block runs
+// dry steals the upper half of the largest remaining block, which balances
+// blocks that happen to cover the expensive parts of the image.
+//
+// Every block is a single atomic word; taking a tile or stealing is one
+// compare-and-swap, with no lock shared between workers.
+class TileScheduler {
+  public:
+    TileScheduler(int numTiles, int numWorkers);
+
+    // Next tile for `worker`, or -1 once every tile has been handed out.
+    int next(int worker);
+
+  private:
+    // [begin, end) packed into one word, begin in the low half.
+    struct alignas(64) Block {
+        std::atomic<uint64_t> range;
+    };
+    static uint64_t pack(uint32_t begin, uint32_t end) {
+        return (uint64_t)end << 32 | begin;
+    }
+    static uint32_t begin(uint64_t range) { return (uint32_t)range; }
+    static uint32_t end(uint64_t range) { return (uint32_t)(range >> 32); }
+
+    int steal(int worker);
+
+    int numWorkers;
+    std::unique_ptr<Block[]> blocks;
+};
+
+#endif // RAYTRACING_TILESCHEDULER_H
@@ -0,0 +1,149 @@
+//
+// Affine transforms for placing object instances.
+//
+
+#ifndef RAYTRACING_TRANSFORM_H
+#define RAYTRACING_TRANSFORM_H
+
+#include <algorithm>
+#include <cmath>
+
+#include "Bounds3.hpp"
+#include "Vector.hpp"
+#include "global.hpp"
+
+// 3x4 affine matrix, the last row of the homogeneous form is implicitly
+// (0, 0, 0, 1). The inverse is kept alongside, as rays are mapped into
+// object space far more often than transforms are built.
+class Transform {
+  public:
+    Transform() {
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j)
+                m[i][j] = inv[i][j] = i == j ? 1.f : 0.f;
+    }
+
+    static Transform Translate(const Vector3f &t) {
+        Transform tr;
+        for (int i = 0; i < 3; ++i) {
+            tr.m[i][3] = t[i];
+            tr.inv[i][3] = -t[i];
+        }
+        return tr;
+    }
+    static Transform Scale(const Vector3f &s) {
+        Transform tr;
+        for (int i = 0; i < 3; ++i) {
+            tr.m[i][i] = s[i];
+            tr.inv[i][i] = 1.f / s[i];
+        }
+        return tr;
+    }
+    static Transform Scale(float s) { return Scale(Vector3f(s)); }
+    // Counter-clockwise rotation by `degrees` around `axis`.
+    static Transform Rotate(float degrees, const Vector3f &axis) {
+        Vector3f a = normalize(axis);
+        float theta = degrees * float(M_PI) / 180.f;
+        float s = std::sin(theta), c = std::cos(theta);
+        Transform tr;
+        tr.m[0][0] = a.x * a.x + (1 - a.x * a.x) * c;
+        tr.m[0][1] = a.x * a.y * (1 - c) - a.z * s;
+        tr.m[0][2] = a.x * a.z * (1 - c) + a.y * s;
+        tr.m[1][0] = a.x * a.y * (1 - c) + a.z * s;
+        tr.m[1][1] = a.y * a.y + (1 - a.y * a.y) * c;
+        tr.m[1][2] = a.y * a.z * (1 - c) - a.x * s;
+        tr.m[2][0] = a.x * a.z * (1 - c) - a.y * s;
+        tr.m[2][1] = a.y * a.z * (1 - c) + a.x * s;
+        tr.m[2][2] = a.z * a.z + (1 - a.z * a.z) * c;
+        // a rotation is orthonormal, its inverse is the transpose
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                tr.inv[i][j] = tr.m[j][i];
+        return tr;
+    }
+
+    // Applies t2 first, then t1.
+    friend Transform operator*(const Transform &t1, const Transform &t2) {
+        Transform tr;
+        Compose(t1.m, t2.m, tr.m);
+        Compose(t2.inv, t1.inv, tr.inv);
+        return tr;
+    }
+
+    [[nodiscard]] Transform Inverse() const {
+        Transform tr;
+        std::copy(&inv[0][0], &inv[0][0] + 12, &tr.m[0][0]);
+        std::copy(&m[0][0], &m[0][0] + 12, &tr.inv[0][0]);
+        return tr;
+    }
+
+    [[nodiscard]] Vector3f Point(const Vector3f &p) const {
+        return Apply(m, p) + Vector3f(m[0][3], m[1][3], m[2][3]);
+    }
+    [[nodiscard]] Vector3f Vector(const Vector3f &v) const {
+        return Apply(m, v);
+    }
+    // Normals go through the inverse transpose to stay perpendicular to the
+    // transformed surface. The result is not normalized.
+    [[nodiscard]] Vector3f Normal(const Vector3f &n) const {
+        return Vector3f(inv[0][0] * n.x + inv[1][0] * n.y + inv[2][0] * n.z,
+                        inv[0][1] * n.x + inv[1][1] * n.y + inv[2][1] * n.z,
+                        inv[0][2] * n.x + inv[1][2] * n.y + inv[2][2] * n.z);
+    }
+    // Maps a transformed normal back onto the direction of the object
+    // space normal, the inverse of Normal up to length. Not normalized.
+    [[nodiscard]] Vector3f InverseNormal(const Vector3f &n) const {
+        return Vector3f(m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+                        m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+                        m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z);
+    }
+    [[nodiscard]] Vector3f InversePoint(const Vector3f &p) const {
+        return Apply(inv, p) + Vector3f(inv[0][3], inv[1][3], inv[2][3]);
+    }
+    [[nodiscard]] Vector3f InverseVector(const Vector3f &v) const {
+        return Apply(inv, v);
+    }
+
+    // Box around all eight transformed corners.
+    [[nodiscard]] Bounds3 Bounds(const Bounds3 &b) const {
+        Bounds3 result;
+        for (int corner = 0; corner < 8; ++corner) {
+            Vector3f p((corner & 1) ? b.pMax.x : b.pMin.x,
+                       (corner & 2) ? b.pMax.y : b.pMin.y,
+                       (corner & 4) ? b.pMax.z : b.pMin.z);
+            result = Union(result, Point(p));
+        }
+        return result;
+    }
+
+    // Determinant of the linear part, the volume scale factor.
+    [[nodiscard]] float Determinant() const {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+  private:
+    using Matrix3x4 = float[3][4];
+
+    static Vector3f Apply(const Matrix3x4 &a, const Vector3f &v) {
+        return Vector3f(a[0][0] * v.x + a[0][1] * v.y + a[0][2] * v.z,
+                        a[1][0] * v.x + a[1][1] * v.y + a[1][2] * v.z,
+                        a[2][0] * v.x + a[2][1] * v.y + a[2][2] * v.z);
+    }
+    // out = a * b for affine 3x4 matrices
+    static void Compose(const Matrix3x4 &a, const Matrix3x4 &b,
+                        Matrix3x4 &out) {
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] +
+                            a[i][2] * b[2][j] + (j == 3 ? a[i][3] : 0.f);
+            }
+        }
+    }
+
+    Matrix3x4 m;
+    Matrix3x4 inv;
+};
+
+#endif // RAYTRACING_TRANSFORM_H
@@ -1,15 +1,19 @@
 #ifndef TRIANGLE_H
 #define TRIANGLE_H
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <unordered_map>
 
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
+#include "MeshCache.hpp"
 #include "OBJ_Loader.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
+#include "TrianglePacket.hpp"
 
 bool rayTriangleIntersect(const Vector3f &v0, const Vector3f &v1,
                           const Vector3f &v2, const Vector3f &orig,
@@ -41,6 +45,42 @@ bool rayTriangleIntersect(const Vector3f &v0, const Vector3f &v1,
     return true;
 }
 
+// Bounds of the part of triangle v0 v1 v2 inside `box`: the triangle is
+// clipped against the six planes of the box (Sutherland-Hodgman) and the
+// remaining polygon bounded.
+inline Bounds3 ClipTriangleBounds(const Vector3f &v0, const Vector3f &v1,
+                                  const Vector3f &v2, const Bounds3 &box) {
+    // each plane adds at most one vertex
+    std::array<Vector3f, 9> polygon = {v0, v1, v2}, clipped;
+    int n = 3;
+    for (int plane = 0; plane < 6 && n > 0; ++plane) {
+        int axis = plane % 3;
+        bool isMax = plane >= 3;
+        float bound = isMax ? box.pMax[axis] : box.pMin[axis];
+        auto inside = [&](const Vector3f &p) {
+            return isMax ? p[axis] <= bound : p[axis] >= bound;
+        };
+        int m = 0;
+        for (int i = 0; i < n; ++i) {
+            const Vector3f &a = polygon[i], &b = polygon[(i + 1) % n];
+            if (inside(a))
+                clipped[m++] = a;
+            if (inside(a) != inside(b)) {
+                float t = (bound - a[axis]) / (b[axis] - a[axis]);
+                Vector3f p = a + (b - a) * t;
+                p[axis] = bound;
+                clipped[m++] = p;
+            }
+        }
+        polygon = clipped;
+        n = m;
+    }
+    Bounds3 bounds;
+    for (int i = 0; i < n; ++i)
+        bounds = Union(bounds, polygon[i]);
+    return bounds;
+}
+
 class Triangle : public Object {
   private:
     Vector3f v0, v1, v2; // vertices A, B ,C , counter-clockwise order
@@ -59,94 +99,383 @@ class Triangle : public Object {
         area = crossProduct(e1, e2).norm() * 0.5f;
     }
 
-    Intersection getIntersection(Ray ray) const override;
+    bool getIntersection(const Ray &ray, float &tMax,
+                         Intersection &isect) const override;
+    void getSurfaceProperties(const Ray &,
+                              Intersection &isect) const override {
+        isect.coords = (1 - isect.u - isect.v) * v0 + isect.u * v1 +
+                       isect.v * v2;
+        isect.normal = normal;
+        isect.m = m;
+    }
+    bool IntersectP(const Ray &ray) const override;
 
     Bounds3 getBounds() const override;
+    Bounds3 clipBounds(const Bounds3 &box) const override {
+        return ClipTriangleBounds(v0, v1, v2, box);
+    }
     void Sample(Intersection &pos, float &pdf) const override {
         float x = std::sqrt(get_random_float()), y = get_random_float();
         pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
         pos.normal = this->normal;
-        pos.emit = m->getEmission();
+        pos.m = m;
+        pos.obj = this;
         pdf = 1.0f / area;
     }
     float getArea() const override { return area; }
+    float getTransformedArea(const Transform &toWorld) const override {
+        return crossProduct(toWorld.Vector(e1), toWorld.Vector(e2)).norm() *
+               0.5f;
+    }
     bool hasEmit() const override { return m->hasEmission(); }
 };
 
+// Indexed triangle mesh: one shared vertex buffer plus three 32-bit vertex
+// indices per triangle. Triangles are stored in BVH leaf order, so a leaf
+// range of the BVH addresses vertexIndex directly.
 class MeshTriangle : public Object {
 
   private:
     Bounds3 bounding_box;
     std::unique_ptr<Vector3f[]> vertices;
-    uint32_t numTriangles;
+    uint32_t numVertices = 0;
+    uint32_t numTriangles = 0;
     std::unique_ptr<uint32_t[]> vertexIndex;
-    std::unique_ptr<Vector2f[]> stCoordinates;
-
-    std::vector<Triangle> triangles;
 
     std::unique_ptr<BVHAccel> bvh;
+    TrianglePackets packets;
+    // Upper bound on triangles per BVH leaf, the builder picks the actual
+    // leaf size by SAH cost.
+    static constexpr int kMaxTrianglesInLeaf = 4;
+    // Running sum of triangle areas, used to sample proportionally to area.
+    std::unique_ptr<float[]> areaCdf;
     float area;
 
     Material *m;
 
+    // Exact position match, used to weld the per-face vertices the loader
+    // produces back into shared ones.
+    struct SamePosition {
+        bool operator()(const Vector3f &a, const Vector3f &b) const {
+            return a.x == b.x && a.y == b.y && a.z == b.z;
+        }
+    };
+
+    // Folded into the cache key next to the model content, so a cache
+    // built with other leaf sizes or node layouts is never picked up.
+    static constexpr uint64_t kCacheParameters =
+        (uint64_t)kMeshCacheVersion << 48 |
+        (uint64_t)sizeof(LinearBVHNode) << 32 |
+        (uint64_t)BVHAccel::SplitMethod::SAH << 16 | kMaxTrianglesInLeaf;
+
   public:
-    MeshTriangle(const std::string &filename, Material *mt) {
-        objl::Loader loader;
-        loader.LoadFile(filename);
+    // Loads the mesh and its BVH from `filename`.bvhcache when that was
+    // written for the current content of the model, otherwise parses the
+    // model, builds the BVH and writes the cache for the next run. Very
+    // large meshes that are never deformed can pass the COMPRESSED layout
+    // to shrink their BVH.
+    MeshTriangle(const std::string &filename, Material *mt,
+                 BVHAccel::NodeLayout layout = BVHAccel::NodeLayout::WIDE) {
         area = 0;
         m = mt;
+        std::string cachePath = filename + ".bvhcache";
+        uint64_t key = HashFileContent(filename, kCacheParameters);
+        if (!key || !loadCache(cachePath, key)) {
+            loadModel(filename);
+            if (key && !saveCache(cachePath, key))
+                std::cerr << "Could not write BVH cache " << cachePath
+                          << "\n";
+        }
+        // the cache holds the binary tree, whatever the layout
+        bvh->setLayout(layout);
+        packets = TrianglePackets(vertices.get(), vertexIndex.get());
+    }
+
+  private:
+    void loadModel(const std::string &filename) {
+        objl::Loader loader;
+        loader.LoadFile(filename);
         assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
+        const auto &mesh = loader.LoadedMeshes[0];
+
+        numTriangles = (uint32_t)(mesh.Vertices.size() / 3);
+        std::vector<Vector3f> welded;
+        std::unordered_map<Vector3f, uint32_t, Vector3fHasher, SamePosition>
+            vertexIds;
+        std::unique_ptr<uint32_t[]> faceIndex(new uint32_t[3 * numTriangles]);
+        for (uint32_t i = 0; i < 3 * numTriangles; ++i) {
+            const auto &pos = mesh.Vertices[i].Position;
+            Vector3f vert(pos.X, pos.Y, pos.Z);
+            auto it = vertexIds.try_emplace(vert, (uint32_t)welded.size());
+            if (it.second)
+                welded.push_back(vert);
+            faceIndex[i] = it.first->second;
+        }
+        numVertices = (uint32_t)welded.size();
+        vertices.reset(new Vector3f[numVertices]);
+        std::copy(welded.begin(), welded.end(), vertices.get());
+
+        std::vector<Bounds3> triangleBounds(numTriangles);
+        for (uint32_t t = 0; t < numTriangles; ++t) {
+            triangleBounds[t] =
+                Union(Bounds3(vertices[faceIndex[3 * t]],
+                              vertices[faceIndex[3 * t + 1]]),
+                      vertices[faceIndex[3 * t + 2]]);
+        }
+        bvh.reset(new BVHAccel(triangleBounds, kMaxTrianglesInLeaf,
+                                BVHAccel::SplitMethod::SAH,
+                                BVHAccel::NodeLayout::BINARY));
+
+        // Store the triangles in leaf order.
+        vertexIndex.reset(new uint32_t[3 * numTriangles]);
+        for (uint32_t t = 0; t < numTriangles; ++t) {
+            uint32_t from = bvh->primitiveOrder.empty()
+                                ? t
+                                : bvh->primitiveOrder[t];
+            for (int j = 0; j < 3; ++j)
+                vertexIndex[3 * t + j] = faceIndex[3 * from + j];
+        }
+        bvh->primitiveOrder = std::vector<uint32_t>();
 
+        areaCdf.reset(new float[numTriangles]);
+        updateBoundsAndArea();
+    }
+
+    void updateBoundsAndArea() {
         Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
                                      std::numeric_limits<float>::infinity(),
                                      std::numeric_limits<float>::infinity()};
         Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-
-            for (int j = 0; j < 3; j++) {
-                Vector3f vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                         mesh.Vertices[i + j].Position.Y,
-                                         mesh.Vertices[i + j].Position.Z);
-                face_vertices[j] = vert;
-                min_vert = Vector3f::Min(min_vert, vert);
-                max_vert = Vector3f::Max(max_vert, vert);
-            }
+        for (uint32_t i = 0; i < numVertices; ++i) {
+            min_vert = Vector3f::Min(min_vert, vertices[i]);
+            max_vert = Vector3f::Max(max_vert, vertices[i]);
+        }
+        bounding_box = Bounds3(min_vert, max_vert);
 
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
+        area = 0;
+        for (uint32_t t = 0; t < numTriangles; ++t) {
+            Vector3f v0 = vertices[vertexIndex[3 * t]];
+            area += crossProduct(vertices[vertexIndex[3 * t + 1]] - v0,
+                                 vertices[vertexIndex[3 * t + 2]] - v0)
+                        .norm() *
+                    0.5f;
+            areaCdf[t] = area;
         }
+    }
 
-        bounding_box = Bounds3(min_vert, max_vert);
+    bool loadCache(const std::string &path, uint64_t key) {
+        MeshCacheReader cache(path, key);
+        if (!cache.valid())
+            return false;
+        const MeshCacheHeader &header = cache.header();
+        if (!cache.holds({sizeof(Vector3f) * (uint64_t)header.numVertices,
+                          sizeof(uint32_t) * 3 * (uint64_t)header.numTriangles,
+                          sizeof(float) * (uint64_t)header.numTriangles,
+                          sizeof(LinearBVHNode) * (uint64_t)header.numNodes}))
+            return false;
+        std::unique_ptr<Vector3f[]> cachedVertices(
+            new Vector3f[header.numVertices]);
+        std::unique_ptr<uint32_t[]> cachedIndex(
+            new uint32_t[3 * header.numTriangles]);
+        std::unique_ptr<float[]> cachedCdf(new float[header.numTriangles]);
+        std::vector<LinearBVHNode> nodes(header.numNodes);
+        if (!cache.read(cachedVertices.get(),
+                        sizeof(Vector3f) * header.numVertices) ||
+            !cache.read(cachedIndex.get(),
+                        sizeof(uint32_t) * 3 * header.numTriangles) ||
+            !cache.read(cachedCdf.get(), sizeof(float) * header.numTriangles) ||
+            !cache.read(nodes.data(), sizeof(LinearBVHNode) * header.numNodes))
+            return false;
+        if (!validCache(header, cachedIndex.get(), nodes))
+            return false;
+
+        numVertices = header.numVertices;
+        numTriangles = header.numTriangles;
+        vertices = std::move(cachedVertices);
+        vertexIndex = std::move(cachedIndex);
+        areaCdf = std::move(cachedCdf);
+        area = header.area;
+        bounding_box = Bounds3(Vector3f(header.boundsMin[0],
+                                        header.boundsMin[1],
+                                        header.boundsMin[2]),
+                               Vector3f(header.boundsMax[0],
+                                        header.boundsMax[1],
+                                        header.boundsMax[2]));
+        bvh.reset(new BVHAccel(std::move(nodes), kMaxTrianglesInLeaf,
+                                BVHAccel::SplitMethod::SAH,
+                                BVHAccel::NodeLayout::BINARY));
+        return true;
+    }
 
-        std::vector<Object *> ptrs;
-        for (auto &tri : triangles) {
-            ptrs.push_back(&tri);
-            area += tri.getArea();
+    // Whether the arrays of a cache only refer to vertices, triangles and
+    // nodes that exist, so a corrupt file can not send the renderer out of
+    // bounds.
+    static bool validCache(const MeshCacheHeader &header,
+                           const uint32_t *index,
+                           const std::vector<LinearBVHNode> &nodes) {
+        for (uint64_t i = 0; i < 3 * (uint64_t)header.numTriangles; ++i)
+            if (index[i] >= header.numVertices)
+                return false;
+        if (header.numTriangles > 0 && nodes.empty())
+            return false;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            const LinearBVHNode &node = nodes[i];
+            if (node.nPrimitives > 0) {
+                if (node.primitivesOffset < 0 ||
+                    (uint64_t)node.primitivesOffset + node.nPrimitives >
+                        header.numTriangles)
+                    return false;
+            } else if (i + 1 >= nodes.size() ||
+                       node.secondChildOffset <= (int)i + 1 ||
+                       (size_t)node.secondChildOffset >= nodes.size()) {
+                return false;
+            }
         }
-        bvh.reset(new BVHAccel(ptrs));
+        return true;
     }
 
-    Bounds3 getBounds() const override { return bounding_box; }
+    bool saveCache(const std::string &path, uint64_t key) const {
+        MeshCacheHeader header;
+        header.key = key;
+        header.numVertices = numVertices;
+        header.numTriangles = numTriangles;
+        header.numNodes = (uint32_t)bvh->nodes.size();
+        header.area = area;
+        for (int axis = 0; axis < 3; ++axis) {
+            header.boundsMin[axis] = bounding_box.pMin[axis];
+            header.boundsMax[axis] = bounding_box.pMax[axis];
+        }
+        return WriteMeshCache(
+            path, header,
+            {{vertices.get(), sizeof(Vector3f) * numVertices},
+             {vertexIndex.get(), sizeof(uint32_t) * 3 * numTriangles},
+             {areaCdf.get(), sizeof(float) * numTriangles},
+             {bvh->nodes.data(), sizeof(LinearBVHNode) * bvh->nodes.size()}});
+    }
 
-    Intersection getIntersection(Ray ray) const override {
-        Intersection intersec;
+  public:
+    // Shared vertex buffer; the connectivity stays fixed, so animation
+    // only has to replace positions.
+    [[nodiscard]] uint32_t getNumVertices() const { return numVertices; }
+    [[nodiscard]] const Vector3f *getVertices() const { return vertices.get(); }
+
+    // Replaces all vertex positions, given in getVertices() order, and
+    // refits the mesh BVH instead of rebuilding it. The scene BVH picks up
+    // the new bounds on Scene::refitBVH. A COMPRESSED mesh BVH is rebuilt
+    // instead.
+    void updateVertices(const std::vector<Vector3f> &positions) {
+        assert(positions.size() == numVertices);
+        std::copy(positions.begin(), positions.end(), vertices.get());
+        std::vector<Bounds3> triangleBounds(numTriangles);
+        for (uint32_t t = 0; t < numTriangles; ++t) {
+            triangleBounds[t] = Union(Bounds3(packets.vertex(t, 0),
+                                              packets.vertex(t, 1)),
+                                      packets.vertex(t, 2));
+        }
+        if (bvh->refit(triangleBounds)) {
+            // parts of the tree were rebuilt, follow their new leaf order
+            std::unique_ptr<uint32_t[]> ordered(new uint32_t[3 * numTriangles]);
+            for (uint32_t t = 0; t < numTriangles; ++t)
+                for (int j = 0; j < 3; ++j)
+                    ordered[3 * t + j] =
+                        vertexIndex[3 * bvh->primitiveOrder[t] + j];
+            vertexIndex = std::move(ordered);
+            bvh->primitiveOrder = std::vector<uint32_t>();
+            packets = TrianglePackets(vertices.get(), vertexIndex.get());
+        }
+        updateBoundsAndArea();
+    }
 
-        if (bvh) {
-            intersec = bvh->Intersect(ray);
+    Bounds3 getBounds() const override { return bounding_box; }
+    Bounds3 clipBounds(const Bounds3 &box) const override {
+        // Exact for small meshes such as the two-triangle walls and boxes
+        // that span large parts of a scene, bounds clipping otherwise.
+        constexpr uint32_t kMaxExactClipTriangles = 64;
+        if (numTriangles > kMaxExactClipTriangles)
+            return Object::clipBounds(box);
+        Bounds3 bounds;
+        for (uint32_t t = 0; t < numTriangles; ++t) {
+            bounds = Union(bounds,
+                           ClipTriangleBounds(packets.vertex(t, 0),
+                                              packets.vertex(t, 1),
+                                              packets.vertex(t, 2), box));
         }
+        return bounds;
+    }
+
+    bool getIntersection(const Ray &ray, float &tMax,
+                         Intersection &isect) const override {
+        if (numTriangles == 0)
+            return false;
+
+        // Only the distance and barycentrics are tracked during traversal,
+        // the surface attributes are filled in once for the closest hit.
+        int index = -1;
+        float u = 0, v = 0;
+        bvh->traverse<false>(ray, tMax, [&](int first, int n, float &tMax) {
+            return packets.intersect(ray, first, n, tMax, index, u, v);
+        });
+        if (index < 0)
+            return false;
+        isect.happened = true;
+        isect.distance = tMax;
+        isect.obj = this;
+        isect.index = (uint32_t)index;
+        isect.u = u;
+        isect.v = v;
+        return true;
+    }
 
-        return intersec;
+    void getSurfaceProperties(const Ray &,
+                              Intersection &isect) const override {
+        Vector3f v0 = packets.vertex(isect.index, 0);
+        Vector3f e1 = packets.vertex(isect.index, 1) - v0;
+        Vector3f e2 = packets.vertex(isect.index, 2) - v0;
+        isect.coords = v0 + isect.u * e1 + isect.v * e2;
+        isect.normal = normalize(crossProduct(e1, e2));
+        isect.m = m;
+    }
+
+    bool IntersectP(const Ray &ray) const override {
+        if (numTriangles == 0)
+            return false;
+        float tMax = ray.t_max;
+        return bvh->traverse<true>(ray, tMax, [&](int first, int n, float &) {
+            return packets.intersectP(ray, first, n, tMax);
+        });
     }
 
     void Sample(Intersection &pos, float &pdf) const override {
-        bvh->Sample(pos, pdf);
-        pos.emit = m->getEmission();
+        float p = std::sqrt(get_random_float()) * area;
+        uint32_t t =
+            std::upper_bound(areaCdf.get(), areaCdf.get() + numTriangles, p) -
+            areaCdf.get();
+        t = std::min(t, numTriangles - 1);
+
+        Vector3f v0 = packets.vertex(t, 0), v1 = packets.vertex(t, 1),
+                 v2 = packets.vertex(t, 2);
+        float x = std::sqrt(get_random_float()), y = get_random_float();
+        pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
+        pos.normal = normalize(crossProduct(v1 - v0, v2 - v0));
+        pos.m = m;
+        pos.obj = this;
+        pos.index = t;
+        pdf = 1.0f / area;
     }
     float getArea() const override { return area; }
+    float getTransformedArea(const Transform &toWorld) const override {
+        float sum = 0;
+        for (uint32_t t = 0; t < numTriangles; ++t) {
+            Vector3f v0 = packets.vertex(t, 0);
+            sum += crossProduct(toWorld.Vector(packets.vertex(t, 1) - v0),
+                                toWorld.Vector(packets.vertex(t, 2) - v0))
+                       .norm() *
+                   0.5f;
+        }
+        return sum;
+    }
     bool hasEmit() const override { return m->hasEmission(); }
 };
 
@@ -154,37 +483,58 @@ inline Bounds3 Triangle::getBounds() const {
     return Union(Bounds3(v0, v1), v2);
 }
 
-inline Intersection Triangle::getIntersection(Ray ray) const {
-    Intersection inter;
+inline bool Triangle::getIntersection(const Ray &ray, float &tMax,
+                                      Intersection &isect) const {
+    if (ray.mirrored ? dotProduct(ray.direction, normal) < 0
+                     : dotProduct(ray.direction, normal) > 0)
+        return false;
+    Vector3f pvec = crossProduct(ray.direction, e2);
+    float det = dotProduct(e1, pvec);
+    if (fabs(det) < EPSILON)
+        return false;
+
+    float det_inv = 1.f / det;
+    Vector3f tvec = ray.origin - v0;
+    float u = dotProduct(tvec, pvec) * det_inv;
+    if (u < 0 || u > 1)
+        return false;
+    Vector3f qvec = crossProduct(tvec, e1);
+    float v = dotProduct(ray.direction, qvec) * det_inv;
+    if (v < 0 || u + v > 1)
+        return false;
+    float t = dotProduct(e2, qvec) * det_inv;
 
-    if (dotProduct(ray.direction, normal) > 0)
-        return inter;
-    double u, v, t_tmp = 0;
+    if (t < 0 || t < ray.t_min || t >= tMax)
+        return false;
+    tMax = t;
+    isect.happened = true;
+    isect.distance = t;
+    isect.obj = this;
+    isect.u = u;
+    isect.v = v;
+    return true;
+}
+
+inline bool Triangle::IntersectP(const Ray &ray) const {
+    if (ray.mirrored ? dotProduct(ray.direction, normal) < 0
+                     : dotProduct(ray.direction, normal) > 0)
+        return false;
     Vector3f pvec = crossProduct(ray.direction, e2);
-    double det = dotProduct(e1, pvec);
+    float det = dotProduct(e1, pvec);
     if (fabs(det) < EPSILON)
-        return inter;
+        return false;
 
-    double det_inv = 1. / det;
+    float det_inv = 1.f / det;
     Vector3f tvec = ray.origin - v0;
-    u = dotProduct(tvec, pvec) * det_inv;
+    float u = dotProduct(tvec, pvec) * det_inv;
     if (u < 0 || u > 1)
-        return inter;
+        return false;
     Vector3f qvec = crossProduct(tvec, e1);
-    v = dotProduct(ray.direction, qvec) * det_inv;
+    float v = dotProduct(ray.direction, qvec) * det_inv;
     if (v < 0 || u + v > 1)
-        return inter;
-    t_tmp = dotProduct(e2, qvec) * det_inv;
-
-    if (t_tmp < 0)
-        return inter;
-    inter.happened = true;
-    inter.coords = (1 - u - v) * v0 + u * v1 + v * v2;
-    inter.distance = t_tmp;
-    inter.obj = this;
-    inter.m = this->m;
-    inter.normal = normal;
-    return inter;
+        return false;
+    float t = dotProduct(e2, qvec) * det_inv;
+    return t >= 0 && t >= ray.t_min && t < ray.t_max;
 }
 
 #endif // TRIANGLE_H
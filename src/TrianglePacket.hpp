@@ -0,0 +1,179 @@
+//
+// Packet intersection of indexed mesh triangles in BVH leaves.
+//
+
+#ifndef RAYTRACING_TRIANGLEPACKET_H
+#define RAYTRACING_TRIANGLEPACKET_H
+
+#include <algorithm>
+#include <cstdint>
+
+#include "Ray.hpp"
+#include "Vector.hpp"
+#include "WideBVH.hpp"
+#include "global.hpp"
+
+// Read-only view of an indexed triangle mesh whose triangles are stored in
+// BVH leaf order. A leaf [first, first + count) is gathered into structure
+// of arrays packets and tested 4 triangles at a time with a vectorised
+// Moller-Trumbore. Only the distance and barycentrics are produced; surface
+// attributes are left to the caller for the final closest hit.
+class TrianglePackets {
+  public:
+    static constexpr int kWidth = 4;
+
+    TrianglePackets() = default;
+    TrianglePackets(const Vector3f *vertices, const uint32_t *indices)
+        : vertices(vertices), indices(indices) {}
+
+    [[nodiscard]] const Vector3f &vertex(int triangle, int corner) const {
+        return vertices[indices[3 * triangle + corner]];
+    }
+
+    // Closest front facing hit (back facing for ray.mirrored) among triangles [first, first + n) inside
+    // [ray.t_min, tMax). On a hit tMax shrinks to it and index/u/v describe
+    // it.
+    bool intersect(const Ray &ray, int first, int n, float &tMax, int &index,
+                   float &u, float &v) const {
+        bool found = false;
+        for (int base = first; base < first + n; base += kWidth) {
+            float t[kWidth], bu[kWidth], bv[kWidth];
+            int valid = std::min(kWidth, first + n - base);
+            int mask = intersectPacket(ray, base, valid, tMax, t, bu, bv);
+            for (int lane = 0; lane < kWidth; ++lane) {
+                if ((mask & (1 << lane)) && t[lane] < tMax) {
+                    tMax = t[lane];
+                    index = base + lane;
+                    u = bu[lane];
+                    v = bv[lane];
+                    found = true;
+                }
+            }
+        }
+        return found;
+    }
+
+    // Any hit among triangles [first, first + n) inside [ray.t_min, tMax).
+    [[nodiscard]] bool intersectP(const Ray &ray, int first, int n,
+                                  float tMax) const {
+        for (int base = first; base < first + n; base += kWidth) {
+            float t[kWidth], bu[kWidth], bv[kWidth];
+            if (intersectPacket(ray, base, std::min(kWidth, first + n - base),
+                                tMax, t, bu, bv))
+                return true;
+        }
+        return false;
+    }
+
+  private:
+    // Tests the `valid` (1..kWidth) triangles starting at base. Returns the
+    // lane mask of hits.
+    int intersectPacket(const Ray &ray, int base, int valid, float tMax,
+                        float t[kWidth], float u[kWidth],
+                        float v[kWidth]) const {
+        // Gather the corners into structure of arrays form, padding unused
+        // lanes with the last triangle; they are masked off below.
+        alignas(16) float p[3][3][kWidth];
+        for (int lane = 0; lane < kWidth; ++lane) {
+            int triangle = base + std::min(lane, valid - 1);
+            for (int corner = 0; corner < 3; ++corner) {
+                const Vector3f &vert = vertex(triangle, corner);
+                p[corner][0][lane] = vert.x;
+                p[corner][1][lane] = vert.y;
+                p[corner][2][lane] = vert.z;
+            }
+        }
+        int validMask = (1 << valid) - 1;
+#ifdef RAYTRACING_HAS_SSE
+        __m128 v0x = _mm_load_ps(p[0][0]), v0y = _mm_load_ps(p[0][1]),
+               v0z = _mm_load_ps(p[0][2]);
+        __m128 e1x = _mm_sub_ps(_mm_load_ps(p[1][0]), v0x);
+        __m128 e1y = _mm_sub_ps(_mm_load_ps(p[1][1]), v0y);
+        __m128 e1z = _mm_sub_ps(_mm_load_ps(p[1][2]), v0z);
+        __m128 e2x = _mm_sub_ps(_mm_load_ps(p[2][0]), v0x);
+        __m128 e2y = _mm_sub_ps(_mm_load_ps(p[2][1]), v0y);
+        __m128 e2z = _mm_sub_ps(_mm_load_ps(p[2][2]), v0z);
+        __m128 dx = _mm_set1_ps(ray.direction.x);
+        __m128 dy = _mm_set1_ps(ray.direction.y);
+        __m128 dz = _mm_set1_ps(ray.direction.z);
+
+        // pvec = dir x e2, det = e1 . pvec
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+            _mm_mul_ps(e1z, pz));
+        // back faces have a negative determinant and are culled, like
+        // Triangle::getIntersection does; mirrored rays cull the front faces
+        __m128 facing =
+            _mm_xor_ps(det, _mm_set1_ps(ray.mirrored ? -0.f : 0.f));
+        __m128 ok = _mm_cmpgt_ps(facing, _mm_set1_ps(EPSILON));
+        __m128 invDet = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+        // tvec = orig - v0, u = (tvec . pvec) / det
+        __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), v0x);
+        __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.origin.y), v0y);
+        __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), v0z);
+        __m128 bu = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)),
+                       _mm_mul_ps(tz, pz)),
+            invDet);
+
+        // qvec = tvec x e1, v = (dir . qvec) / det, t = (e2 . qvec) / det
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        __m128 bv = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                       _mm_mul_ps(dz, qz)),
+            invDet);
+        __m128 bt = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                       _mm_mul_ps(e2z, qz)),
+            invDet);
+
+        __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+        __m128 tMin = _mm_set1_ps(std::max(0.f, ray.t_min));
+        ok = _mm_and_ps(ok, _mm_cmpge_ps(bu, zero));
+        ok = _mm_and_ps(ok, _mm_cmpge_ps(bv, zero));
+        ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_add_ps(bu, bv), one));
+        ok = _mm_and_ps(ok, _mm_cmpge_ps(bt, tMin));
+        ok = _mm_and_ps(ok, _mm_cmplt_ps(bt, _mm_set1_ps(tMax)));
+        _mm_storeu_ps(t, bt);
+        _mm_storeu_ps(u, bu);
+        _mm_storeu_ps(v, bv);
+        return _mm_movemask_ps(ok) & validMask;
+#else
+        int mask = 0;
+        Vector3f dir = ray.direction;
+        for (int lane = 0; lane < valid; ++lane) {
+            Vector3f v0(p[0][0][lane], p[0][1][lane], p[0][2][lane]);
+            Vector3f e1 =
+                Vector3f(p[1][0][lane], p[1][1][lane], p[1][2][lane]) - v0;
+            Vector3f e2 =
+                Vector3f(p[2][0][lane], p[2][1][lane], p[2][2][lane]) - v0;
+            Vector3f pvec = crossProduct(dir, e2);
+            float det = dotProduct(e1, pvec);
+            if (!((ray.mirrored ? -det : det) > EPSILON))
+                continue;
+            float invDet = 1.f / det;
+            Vector3f tvec = ray.origin - v0;
+            u[lane] = dotProduct(tvec, pvec) * invDet;
+            Vector3f qvec = crossProduct(tvec, e1);
+            v[lane] = dotProduct(dir, qvec) * invDet;
+            t[lane] = dotProduct(e2, qvec) * invDet;
+            bool hit = u[lane] >= 0 && v[lane] >= 0 && u[lane] + v[lane] <= 1 &&
+                       t[lane] >= std::max(0.f, ray.t_min) &&
+                       t[lane] < tMax;
+            mask |= hit << lane;
+        }
+        return mask & validMask;
+#endif
+    }
+
+    const Vector3f *vertices = nullptr;
+    const uint32_t *indices = nullptr;
+};
+
+#endif // RAYTRACING_TRIANGLEPACKET_H
@@ -0,0 +1,53 @@
+//
+// Lock-free hand-over of whole frames between one writer and one reader.
+//
+
+#ifndef RAYTRACING_TRIPLEBUFFER_H
+#define RAYTRACING_TRIPLEBUFFER_H
+
+#include <atomic>
+
+// Three copies of T rotate between the writer (back), the reader (front)
+// and a ready slot in between. publish() and acquire() each swap their copy
+// with the ready one in a single atomic exchange, so neither side ever
+// waits for the other or copies a frame, and the reader always sees the
+// latest complete frame.
+template <typename T> class TripleBuffer {
+  public:
+    // Sets all three copies. Only while neither side is using the buffer.
+    void reset(const T &value) {
+        for (T &slot : slots)
+            slot = value;
+    }
+
+    // Writer side: the copy to fill, then hand it over with publish().
+    T &back() { return slots[backIndex]; }
+    void publish() {
+        backIndex =
+            ready.exchange(backIndex | kFresh, std::memory_order_acq_rel) &
+            kIndexMask;
+    }
+
+    // Reader side: moves the latest published copy to the front, returns
+    // false if there was none since the last call.
+    bool acquire() {
+        if (!(ready.load(std::memory_order_relaxed) & kFresh))
+            return false;
+        frontIndex =
+            ready.exchange(frontIndex, std::memory_order_acq_rel) & kIndexMask;
+        return true;
+    }
+    const T &front() const { return slots[frontIndex]; }
+
+  private:
+    static constexpr int kIndexMask = 3;
+    // set in `ready` while it holds a copy the reader has not taken yet
+    static constexpr int kFresh = 4;
+
+    T slots[3];
+    int backIndex = 0;
+    int frontIndex = 1;
+    std::atomic<int> ready{2};
+};
+
+#endif // RAYTRACING_TRIPLEBUFFER_H
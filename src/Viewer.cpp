@@ -0,0 +1,134 @@
+//
+// Interactive SFML front end of the Renderer.
+//
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "Profiler.h"
+#include "Viewer.hpp"
+
+void Viewer::WindowMain(const std::string &file, size_t width,
+                        size_t height) {
+    sf::Event event{};
+    while (m_window.isOpen()) {
+        m_renderer.AcquireFrame();
+        const std::vector<Vector3f> &frame = m_renderer.Frame();
+        while (m_window.pollEvent(event)) {
+            if (event.type == sf::Event::Closed ||
+                (event.type == sf::Event::KeyPressed &&
+                 event.key.code == sf::Keyboard::Escape)) {
+                m_window.close();
+                exit = true;
+                m_renderer.Cancel();
+                return;
+            }
+
+            if (event.type == sf::Event::KeyPressed) {
+                const SAMPLE sample = next_sample;
+                const float rate = next_rate;
+                switch (event.key.code) {
+                case sf::Keyboard::Q:
+                    next_sample = SAMPLE::BRDF;
+                    std::cout << "next sample: BRDF" << std::endl;
+                    break;
+                case sf::Keyboard::W:
+                    next_sample = SAMPLE::MIS;
+                    std::cout << "next sample: MIS" << std::endl;
+                    break;
+                case sf::Keyboard::E:
+                    next_sample = SAMPLE::LIGHT;
+                    std::cout << "next sample: LIGHT" << std::endl;
+                    break;
+                case sf::Keyboard::Up:
+                    next_rate = std::min(rate + 0.05f, 1.f);
+                    std::cout << "next rate: " << next_rate << std::endl;
+                    break;
+                case sf::Keyboard::Down:
+                    next_rate = std::max(rate - 0.05f, 0.f);
+                    std::cout << "next rate: " << next_rate << std::endl;
+                    break;
+                case sf::Keyboard::S:
+                    next_save = !next_save;
+                    break;
+                default:
+                    break;
+                }
+                // drop the image of the old settings right away
+                if (next_sample != sample || next_rate != rate)
+                    m_renderer.Cancel();
+            }
+        }
+
+        if (next_save) {
+            std::cout << "file save to : " << file << std::endl;
+
+            saveFramebuffer(file, width, height, frame);
+            next_save = false;
+        }
+        std::vector<sf::Color> colors;
+        colors.resize(frame.size());
+        size_t m = 0;
+        for (uint32_t i = 0; i < width; ++i) {
+            for (uint32_t j = 0; j < height; ++j) {
+                const Vector3f color =
+                    Vector3f::Min(frame[m], Vector3f{1, 1, 1});
+                colors[j * width + i] = sf::Color(255 * color.x, 255 * color.y,
+                                        255 * color.z);
+                m += 1;
+            }
+        }
+        m_screen.fillPixel(colors);
+        m_window.draw(m_screen);
+        m_window.display();
+
+        std::this_thread::sleep_for(std::chrono::microseconds(17));
+    }
+}
+
+// The main render function. The image is refined on a separate thread, pass
+// by pass, and every pass is shown as it finishes; the window saves the
+// current image to file on request. A change of the sampling settings
+// cancels the pass in flight, and the thread starts over with the new
+// settings; a finished image is kept until then.
+void Viewer::Render(Scene &scene, const std::string &file) {
+    m_window.create(sf::VideoMode(scene.width, scene.height), "Render",
+                    sf::Style::Titlebar | sf::Style::Close);
+    m_window.setVerticalSyncEnabled(true);
+    m_screen.create(scene.width, scene.height, 1.f, sf::Color::White);
+    m_renderer.Reset(scene);
+    next_rate = scene.config.mis_rate;
+    next_sample = scene.config.sample;
+
+    // change the spp value to change sample amount
+    std::cout << "SPP: " << m_renderer.Options().spp << "\n";
+    std::thread th = std::thread([&scene, this]() {
+        while (!exit) {
+            // Reset clears the cancel before the settings are read, so a
+            // change that misses this image still cancels it. The window
+            // sets exit before it cancels, so a quit whose cancel was
+            // cleared here is seen right after.
+            m_renderer.Reset(scene);
+            if (exit)
+                break;
+            if (scene.UpdateRenderConfig(next_sample, next_rate)) {
+                std::cout << "Update sample: " << scene.config.sample
+                          << " rate: " << scene.config.mis_rate << "\n";
+            }
+            {
+                RAIIProfiler profiler;
+                while (!exit && !m_renderer.Finished() &&
+                       m_renderer.RenderPass(scene))
+                    UpdateProgress(m_renderer.Progress());
+                std::cout << "\n";
+            }
+
+            while (!exit && !m_renderer.Cancelled())
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    WindowMain(file, scene.width, scene.height);
+    th.join();
+}
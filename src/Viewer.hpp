@@ -0,0 +1,39 @@
+//
+// Interactive SFML front end of the Renderer.
+//
+
+#ifndef RAYTRACING_VIEWER_H
+#define RAYTRACING_VIEWER_H
+
+#include <SFML/Graphics.hpp>
+#include <atomic>
+#include <string>
+
+#include "Renderer.hpp"
+#include "Scene.hpp"
+#include "VirtualScreen.hpp"
+
+// Shows the frames of a Renderer in a window while they are rendered.
+// Q/W/E switch to BRDF/MIS/light sampling, Up/Down change the MIS rate, S
+// saves the current frame to file and Escape quits.
+class Viewer {
+  public:
+    explicit Viewer(const RenderOptions &options = {}) : m_renderer(options) {}
+    void Render(Scene &scene, const std::string &file = "binary.ppm");
+
+  private:
+    void WindowMain(const std::string &file, size_t width, size_t height);
+
+    Renderer m_renderer;
+    sf::RenderWindow m_window;
+    VirtualScreen m_screen;
+
+    // Keyboard control. The window writes the settings, then cancels the
+    // pass in flight; the render thread picks them up for the next image.
+    std::atomic<bool> exit = false;
+    std::atomic<SAMPLE> next_sample;
+    std::atomic<float> next_rate;
+    bool next_save = false;
+};
+
+#endif // RAYTRACING_VIEWER_H
@@ -0,0 +1,247 @@
+#include "WideBVH.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "BVH.hpp"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+template <int N>
+static int collapseNode(const std::vector<LinearBVHNode> &binary,
+                        int binaryIndex, std::vector<WideBVHNode<N>> &wide) {
+    int wideIndex = (int)wide.size();
+    wide.emplace_back();
+
+    // Open the interior child with the largest surface area until all N
+    // slots are used or only leaves remain.
+    std::array<int, N> children;
+    int nChildren = 0;
+    const LinearBVHNode &root = binary[binaryIndex];
+    if (root.nPrimitives > 0) {
+        children[nChildren++] = binaryIndex;
+    } else {
+        children[nChildren++] = binaryIndex + 1;
+        children[nChildren++] = root.secondChildOffset;
+    }
+    while (nChildren < N) {
+        int best = -1;
+        double bestArea = -1;
+        for (int i = 0; i < nChildren; ++i) {
+            const LinearBVHNode &node = binary[children[i]];
+            if (node.nPrimitives == 0 && node.bounds.SurfaceArea() > bestArea) {
+                best = i;
+                bestArea = node.bounds.SurfaceArea();
+            }
+        }
+        if (best < 0)
+            break;
+        int opened = children[best];
+        children[best] = opened + 1;
+        children[nChildren++] = binary[opened].secondChildOffset;
+    }
+
+    for (int i = 0; i < nChildren; ++i) {
+        const LinearBVHNode &node = binary[children[i]];
+        int32_t child;
+        uint8_t nPrimitives;
+        if (node.nPrimitives > 0) {
+            child = node.primitivesOffset;
+            nPrimitives = (uint8_t)node.nPrimitives;
+        } else {
+            child = collapseNode(binary, children[i], wide);
+            nPrimitives = 0;
+        }
+        // wide may have been reallocated by the recursion
+        WideBVHNode<N> &out = wide[wideIndex];
+        for (int axis = 0; axis < 3; ++axis) {
+            out.bounds[0][axis][i] = node.bounds.pMin[axis];
+            out.bounds[1][axis][i] = node.bounds.pMax[axis];
+        }
+        out.child[i] = child;
+        out.nPrimitives[i] = nPrimitives;
+    }
+    return wideIndex;
+}
+
+template <int N>
+void CollapseBVH(const std::vector<LinearBVHNode> &binary,
+                 std::vector<WideBVHNode<N>> &wide) {
+    wide.clear();
+    if (binary.empty())
+        return;
+    // roughly (N - 1) binary interior nodes fold into each wide node
+    wide.reserve(binary.size() / (N - 1) + 1);
+    collapseNode(binary, 0, wide);
+}
+
+template void CollapseBVH<4>(const std::vector<LinearBVHNode> &,
+                             std::vector<WideBVHNode<4>> &);
+template void CollapseBVH<8>(const std::vector<LinearBVHNode> &,
+                             std::vector<WideBVHNode<8>> &);
+
+// Smallest power of two step that spans extent in 253 steps, which leaves
+// compressNode room for one step of rounding and one of margin above the
+// exact maximum.
+static int gridExponent(float extent) {
+    int exponent;
+    std::frexp(extent / 253.f, &exponent);
+    // frexp yields 2^exponent > extent / 253
+    return std::clamp(exponent, -126, 127);
+}
+
+template <int N>
+static CompressedWideBVHNode<N> compressNode(const WideBVHNode<N> &node) {
+    CompressedWideBVHNode<N> out;
+    for (int axis = 0; axis < 3; ++axis) {
+        float lo = std::numeric_limits<float>::infinity();
+        float hi = -std::numeric_limits<float>::infinity();
+        for (int i = 0; i < N; ++i) {
+            if (node.bounds[0][axis][i] <= node.bounds[1][axis][i]) {
+                lo = std::min(lo, node.bounds[0][axis][i]);
+                hi = std::max(hi, node.bounds[1][axis][i]);
+            }
+        }
+        out.origin[axis] = lo;
+        out.exponent[axis] = (int8_t)gridExponent(hi - lo);
+        float scale = out.scale(axis);
+        for (int i = 0; i < N; ++i) {
+            float childLo = node.bounds[0][axis][i];
+            float childHi = node.bounds[1][axis][i];
+            if (childLo > childHi)
+                continue; // unused slot
+            // Round outwards, then step further out until the plane lies
+            // outside the exact one.
+            int qLo = std::clamp((int)std::floor((childLo - lo) / scale), 0,
+                                 255);
+            while (qLo > 0 && lo + qLo * scale > childLo)
+                --qLo;
+            int qHi =
+                std::clamp((int)std::ceil((childHi - lo) / scale), 0, 255);
+            while (qHi < 255 && lo + qHi * scale < childHi)
+                ++qHi;
+            // The traversal decodes q * scale + (origin - org) instead, which
+            // rounds origin - org first. One more step of margin absorbs that
+            // for ray origins within about 2^16 node extents; q = 0 needs
+            // none, it decodes to exactly the plane of the node's own box.
+            qLo = std::max(qLo - 1, 0);
+            qHi = std::min(qHi + 1, 255);
+            out.q[0][axis][i] = (uint8_t)qLo;
+            out.q[1][axis][i] = (uint8_t)qHi;
+        }
+    }
+    for (int i = 0; i < N; ++i) {
+        out.child[i] = node.child[i];
+        out.nPrimitives[i] = node.nPrimitives[i];
+    }
+    return out;
+}
+
+template <int N>
+void CompressBVH(const std::vector<WideBVHNode<N>> &wide,
+                 std::vector<CompressedWideBVHNode<N>> &compressed) {
+    compressed.resize(wide.size());
+    for (size_t i = 0; i < wide.size(); ++i)
+        compressed[i] = compressNode(wide[i]);
+}
+
+template void CompressBVH<4>(const std::vector<WideBVHNode<4>> &,
+                             std::vector<CompressedWideBVHNode<4>> &);
+template void CompressBVH<8>(const std::vector<WideBVHNode<8>> &,
+                             std::vector<CompressedWideBVHNode<8>> &);
+
+static bool cpuSupportsAVX() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx");
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+    // CPUID.1:ECX.AVX[bit 28] and the OS saving YMM state (OSXSAVE[bit 27]
+    // plus XCR0 bits 1 and 2).
+    int info[4];
+    __cpuid(info, 1);
+    bool avx = (info[2] & (1 << 28)) && (info[2] & (1 << 27));
+    return avx && (_xgetbv(0) & 0x6) == 0x6;
+#else
+    return false;
+#endif
+}
+
+int WidestBVHWidth() {
+    static const int width = cpuSupportsAVX() ? 8 : 4;
+    return width;
+}
+
+#ifdef RAYTRACING_HAS_SSE
+#if defined(__GNUC__)
+__attribute__((target("avx")))
+#endif
+int IntersectChildrenAVX(const WideBVHNode<8> &node, const WideRay &ray,
+                         float tMax, float tEntry[8]) {
+    __m256 t0 = _mm256_set1_ps(ray.tMin);
+    __m256 t1 = _mm256_set1_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis) {
+        __m256 org = _mm256_set1_ps(ray.org[axis]);
+        __m256 invDir = _mm256_set1_ps(ray.invDir[axis]);
+        __m256 tNear = _mm256_mul_ps(
+            _mm256_sub_ps(
+                _mm256_load_ps(node.bounds[ray.dirIsNeg[axis]][axis]), org),
+            invDir);
+        __m256 tFar = _mm256_mul_ps(
+            _mm256_sub_ps(
+                _mm256_load_ps(node.bounds[1 - ray.dirIsNeg[axis]][axis]),
+                org),
+            invDir);
+        t0 = _mm256_max_ps(tNear, t0);
+        t1 = _mm256_min_ps(tFar, t1);
+    }
+    _mm256_storeu_ps(tEntry, t0);
+    t1 = _mm256_mul_ps(t1, _mm256_set1_ps(kSlabExitScale));
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+
+// Widens eight bytes to floats. AVX has no 256 bit integer unpack, so the
+// halves are widened separately.
+#if defined(__GNUC__)
+__attribute__((target("avx")))
+#endif
+static inline __m256 planes(const uint8_t *q) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(q)), zero);
+    __m256i wide = _mm256_insertf128_si256(
+        _mm256_castsi128_si256(_mm_unpacklo_epi16(v, zero)),
+        _mm_unpackhi_epi16(v, zero), 1);
+    return _mm256_cvtepi32_ps(wide);
+}
+
+#if defined(__GNUC__)
+__attribute__((target("avx")))
+#endif
+int IntersectChildrenAVX(const CompressedWideBVHNode<8> &node,
+                         const WideRay &ray, float tMax, float tEntry[8]) {
+    __m256 t0 = _mm256_set1_ps(ray.tMin);
+    __m256 t1 = _mm256_set1_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis) {
+        __m256 scale = _mm256_set1_ps(node.scale(axis));
+        __m256 offset = _mm256_set1_ps(node.origin[axis] - ray.org[axis]);
+        __m256 invDir = _mm256_set1_ps(ray.invDir[axis]);
+        __m256 tNear = _mm256_mul_ps(
+            _mm256_add_ps(
+                _mm256_mul_ps(planes(node.q[ray.dirIsNeg[axis]][axis]), scale),
+                offset),
+            invDir);
+        __m256 tFar = _mm256_mul_ps(
+            _mm256_add_ps(
+                _mm256_mul_ps(planes(node.q[1 - ray.dirIsNeg[axis]][axis]),
+                              scale),
+                offset),
+            invDir);
+        t0 = _mm256_max_ps(tNear, t0);
+        t1 = _mm256_min_ps(tFar, t1);
+    }
+    _mm256_storeu_ps(tEntry, t0);
+    t1 = _mm256_mul_ps(t1, _mm256_set1_ps(kSlabExitScale));
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
@@ -0,0 +1,321 @@
+//
+// Wide (4/8 children) BVH collapsed from the binary LinearBVHNode tree, and
+// its compressed form with quantized child bounds.
+//
+
+#ifndef RAYTRACING_WIDEBVH_H
+#define RAYTRACING_WIDEBVH_H
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define RAYTRACING_HAS_SSE 1
+#include <immintrin.h>
+#endif
+
+#include "Bounds3.hpp"
+#include "Ray.hpp"
+
+struct LinearBVHNode;
+
+// Tree depth the traversal stacks hold without a heap allocation.
+constexpr int kInlineStackDepth = 64;
+
+// Child bounds are stored as structure of arrays, so one slab test covers
+// all N children: bounds[0] holds the minimum, bounds[1] the maximum corner,
+// each split by axis. Unused slots hold an inverted (empty) box.
+template <int N> struct alignas(64) WideBVHNode {
+    float bounds[2][3][N];
+    // interior child: index of its WideBVHNode, leaf child: first primitive
+    int32_t child[N];
+    // 0 -> interior child (or empty slot), otherwise leaf primitive count
+    uint8_t nPrimitives[N];
+
+    WideBVHNode() {
+        for (int i = 0; i < N; ++i) {
+            for (int axis = 0; axis < 3; ++axis) {
+                bounds[0][axis][i] = std::numeric_limits<float>::infinity();
+                bounds[1][axis][i] = -std::numeric_limits<float>::infinity();
+            }
+            child[i] = -1;
+            nPrimitives[i] = 0;
+        }
+    }
+};
+
+// Wide node with the child bounds quantized to 8 bits on a grid spanning
+// the node's own bounds: child box = origin + q * 2^exponent per axis,
+// rounded outwards by a step more than needed, so decoded boxes enclose the
+// exact ones despite the rounding of the traversal. Layout as in
+// WideBVHNode; unused slots hold an inverted box, minimum 255, maximum 0. At
+// 104 bytes for N = 8 and 60 bytes for N = 4 it is less than half the
+// size of the float node.
+template <int N> struct CompressedWideBVHNode {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t pad;
+    uint8_t q[2][3][N];
+    int32_t child[N];
+    uint8_t nPrimitives[N];
+
+    CompressedWideBVHNode() {
+        for (int i = 0; i < N; ++i) {
+            for (int axis = 0; axis < 3; ++axis) {
+                q[0][axis][i] = 255;
+                q[1][axis][i] = 0;
+            }
+            child[i] = -1;
+            nPrimitives[i] = 0;
+        }
+        for (int axis = 0; axis < 3; ++axis) {
+            origin[axis] = 0;
+            exponent[axis] = 0;
+        }
+        pad = 0;
+    }
+
+    // 2^exponent[axis], built directly from the float bit pattern
+    [[nodiscard]] float scale(int axis) const {
+        uint32_t bits = uint32_t(exponent[axis] + 127) << 23;
+        float s;
+        std::memcpy(&s, &bits, sizeof(s));
+        return s;
+    }
+};
+
+// Ray data in the form the wide slab test consumes.
+struct WideRay {
+    explicit WideRay(const Ray &ray)
+        : org{ray.origin.x, ray.origin.y, ray.origin.z},
+          invDir{ray.direction_inv.x, ray.direction_inv.y,
+                 ray.direction_inv.z},
+          dirIsNeg{invDir[0] < 0, invDir[1] < 0, invDir[2] < 0},
+          tMin(ray.t_min) {}
+    float org[3];
+    float invDir[3];
+    int dirIsNeg[3];
+    float tMin;
+};
+
+// Builds the wide tree from the depth-first binary layout by repeatedly
+// opening the child with the largest surface area until N slots are used.
+template <int N>
+void CollapseBVH(const std::vector<LinearBVHNode> &binary,
+                 std::vector<WideBVHNode<N>> &wide);
+
+// Quantizes every node of wide, keeping its child indices.
+template <int N>
+void CompressBVH(const std::vector<WideBVHNode<N>> &wide,
+                 std::vector<CompressedWideBVHNode<N>> &compressed);
+
+// Widest node supported by this CPU: 8 with AVX, otherwise 4.
+int WidestBVHWidth();
+
+// Slab test of a ray against all children of a node. Returns a bit mask of
+// the children hit within [ray.tMin, tMax], exits widened by kSlabExitScale,
+// and their entry distances.
+template <int N>
+inline int IntersectChildren(const WideBVHNode<N> &node, const WideRay &ray,
+                             float tMax, float tEntry[N]) {
+    int mask = 0;
+    for (int i = 0; i < N; ++i) {
+        float t0 = ray.tMin, t1 = tMax;
+        for (int axis = 0; axis < 3; ++axis) {
+            float tNear = (node.bounds[ray.dirIsNeg[axis]][axis][i] -
+                           ray.org[axis]) *
+                          ray.invDir[axis];
+            float tFar = (node.bounds[1 - ray.dirIsNeg[axis]][axis][i] -
+                          ray.org[axis]) *
+                         ray.invDir[axis];
+            t0 = tNear > t0 ? tNear : t0;
+            t1 = tFar < t1 ? tFar : t1;
+        }
+        tEntry[i] = t0;
+        mask |= (t0 <= t1 * kSlabExitScale) << i;
+    }
+    return mask;
+}
+
+// Same for a compressed node, decoding the planes relative to the ray
+// origin: a plane at origin + q * scale is crossed at
+// t = (q * scale + (origin - org)) * invDir. Folding invDir into the
+// first two terms would save a multiply, but turns the 0 * inf of axis
+// parallel rays into NaNs that disable culling on that axis.
+template <int N>
+inline int IntersectChildren(const CompressedWideBVHNode<N> &node,
+                             const WideRay &ray, float tMax, float tEntry[N]) {
+    float scale[3], offset[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        scale[axis] = node.scale(axis);
+        offset[axis] = node.origin[axis] - ray.org[axis];
+    }
+    int mask = 0;
+    for (int i = 0; i < N; ++i) {
+        float t0 = ray.tMin, t1 = tMax;
+        for (int axis = 0; axis < 3; ++axis) {
+            float tNear = (node.q[ray.dirIsNeg[axis]][axis][i] * scale[axis] +
+                           offset[axis]) *
+                          ray.invDir[axis];
+            float tFar =
+                (node.q[1 - ray.dirIsNeg[axis]][axis][i] * scale[axis] +
+                 offset[axis]) *
+                ray.invDir[axis];
+            t0 = tNear > t0 ? tNear : t0;
+            t1 = tFar < t1 ? tFar : t1;
+        }
+        tEntry[i] = t0;
+        mask |= (t0 <= t1 * kSlabExitScale) << i;
+    }
+    return mask;
+}
+
+#ifdef RAYTRACING_HAS_SSE
+template <>
+inline int IntersectChildren<4>(const WideBVHNode<4> &node, const WideRay &ray,
+                                float tMax, float tEntry[4]) {
+    __m128 t0 = _mm_set1_ps(ray.tMin);
+    __m128 t1 = _mm_set1_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis) {
+        __m128 org = _mm_set1_ps(ray.org[axis]);
+        __m128 invDir = _mm_set1_ps(ray.invDir[axis]);
+        __m128 tNear = _mm_mul_ps(
+            _mm_sub_ps(_mm_load_ps(node.bounds[ray.dirIsNeg[axis]][axis]), org),
+            invDir);
+        __m128 tFar = _mm_mul_ps(
+            _mm_sub_ps(_mm_load_ps(node.bounds[1 - ray.dirIsNeg[axis]][axis]),
+                       org),
+            invDir);
+        // the running interval is the second operand, so a NaN slab
+        // (origin on the plane of a flat box) leaves it unchanged
+        t0 = _mm_max_ps(tNear, t0);
+        t1 = _mm_min_ps(tFar, t1);
+    }
+    _mm_storeu_ps(tEntry, t0);
+    t1 = _mm_mul_ps(t1, _mm_set1_ps(kSlabExitScale));
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+// Defined in WideBVH.cpp, compiled for AVX and only called when the CPU
+// supports it.
+int IntersectChildrenAVX(const WideBVHNode<8> &node, const WideRay &ray,
+                         float tMax, float tEntry[8]);
+
+template <>
+inline int IntersectChildren<8>(const WideBVHNode<8> &node, const WideRay &ray,
+                                float tMax, float tEntry[8]) {
+    return IntersectChildrenAVX(node, ray, tMax, tEntry);
+}
+
+template <>
+inline int IntersectChildren<4>(const CompressedWideBVHNode<4> &node,
+                                const WideRay &ray, float tMax,
+                                float tEntry[4]) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128 t0 = _mm_set1_ps(ray.tMin);
+    __m128 t1 = _mm_set1_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis) {
+        __m128 scale = _mm_set1_ps(node.scale(axis));
+        __m128 offset = _mm_set1_ps(node.origin[axis] - ray.org[axis]);
+        __m128 invDir = _mm_set1_ps(ray.invDir[axis]);
+        // widen the four bytes of each plane to floats
+        auto planes = [&](const uint8_t *q) {
+            int32_t bytes;
+            std::memcpy(&bytes, q, sizeof(bytes));
+            __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+            return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+        };
+        __m128 tNear = _mm_mul_ps(
+            _mm_add_ps(
+                _mm_mul_ps(planes(node.q[ray.dirIsNeg[axis]][axis]), scale),
+                offset),
+            invDir);
+        __m128 tFar = _mm_mul_ps(
+            _mm_add_ps(
+                _mm_mul_ps(planes(node.q[1 - ray.dirIsNeg[axis]][axis]),
+                           scale),
+                offset),
+            invDir);
+        t0 = _mm_max_ps(tNear, t0);
+        t1 = _mm_min_ps(tFar, t1);
+    }
+    _mm_storeu_ps(tEntry, t0);
+    t1 = _mm_mul_ps(t1, _mm_set1_ps(kSlabExitScale));
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+int IntersectChildrenAVX(const CompressedWideBVHNode<8> &node,
+                         const WideRay &ray, float tMax, float tEntry[8]);
+
+template <>
+inline int IntersectChildren<8>(const CompressedWideBVHNode<8> &node,
+                                const WideRay &ray, float tMax,
+                                float tEntry[8]) {
+    return IntersectChildrenAVX(node, ray, tMax, tEntry);
+}
+#endif
+
+// Front-to-back traversal of WideBVHNode<N> or CompressedWideBVHNode<N>
+// nodes. leaf(firstPrimitive, nPrimitives, tMax) tests a leaf, shrinks tMax
+// on a closer hit and returns whether it hit anything. With AnyHit the walk
+// stops at the first leaf that reports a hit. maxDepth bounds the depth of
+// the binary tree the nodes were collapsed from, and with it their depth.
+template <int N, bool AnyHit, typename Node, typename LeafFn>
+bool TraverseWideBVH(const std::vector<Node> &nodes, int maxDepth,
+                     const Ray &r, float &tMax, LeafFn &&leaf) {
+    struct StackEntry {
+        int32_t index;
+        int32_t nPrimitives;
+        float tEntry;
+    };
+    // Every level pushes at most N - 1 entries. Trees deeper than the inline
+    // stack, e.g. Morton order builds over clustered primitives, spill to
+    // the heap.
+    std::array<StackEntry, kInlineStackDepth * (N - 1) + 1> inlineStack;
+    std::unique_ptr<StackEntry[]> heapStack;
+    StackEntry *stack = inlineStack.data();
+    if (maxDepth > kInlineStackDepth) {
+        heapStack.reset(new StackEntry[maxDepth * (N - 1) + 1]);
+        stack = heapStack.get();
+    }
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, -std::numeric_limits<float>::infinity()};
+
+    WideRay ray(r);
+    bool hit = false;
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.tEntry > tMax)
+            continue;
+        if (entry.nPrimitives > 0) {
+            if (leaf(entry.index, entry.nPrimitives, tMax)) {
+                hit = true;
+                if (AnyHit)
+                    return true;
+            }
+            continue;
+        }
+
+        const Node &node = nodes[entry.index];
+        float tEntry[N];
+        int mask = IntersectChildren<N>(node, ray, tMax, tEntry);
+        // Push hit children far to near so the nearest is popped first.
+        int first = stackSize;
+        for (int i = 0; i < N; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            StackEntry child = {node.child[i], node.nPrimitives[i], tEntry[i]};
+            int j = stackSize++;
+            for (; j > first && stack[j - 1].tEntry < child.tEntry; --j)
+                stack[j] = stack[j - 1];
+            stack[j] = child;
+        }
+    }
+    return hit;
+}
+
+#endif // RAYTRACING_WIDEBVH_H
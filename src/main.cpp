@@ -1,18 +1,61 @@
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <string>
 
+#include "Instance.hpp"
 #include "Renderer.hpp"
 #include "Scene.hpp"
 #include "Sphere.hpp"
 #include "Triangle.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
+#ifdef RAYTRACING_VIEWER
+#include "Viewer.hpp"
+#endif
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
 // maximum recursion depth, field-of-view, etc.). We then call the render
 // function().
+//
+// Usage: RayTracing [-MIS|-LIGHT|-BRDF] [--headless] [options] [file]
+// --headless renders one frame to file and exits instead of opening the
+// viewer. Builds without the viewer always do that.
+//
+// Options, defaults in brackets:
+//   --spp N       samples per pixel of a finished image [128]
+//   --batch N     samples per pixel each pass adds [8]
+//   --threads N   render threads, 0 for one per hardware thread [0]
+//   --time S      finish the image after S seconds, 0 for no limit [0]
+//   --error E     finish once every pixel's standard error is below E
+//                 times its brightness, 0 for no target [0]
+//   --adaptive    spend samples on the pixels with the highest error
+//                 instead of evenly, --spp capping each pixel; needs --error
+//   --budget N    finish after N samples per pixel on average, 0 for no
+//                 limit [0]
+//   --size WxH    resolution [196x196]
+//   --depth N     maximum number of bounces [105]
+//   --rr P        Russian roulette continuation probability [0.8]
+//   --bvh M       builder of the scene BVH: naive, sah, sbvh (spatial
+//                 splits), lbvh or trbvh (Morton order, + treelets) [sah]
+//   --layout L    node layout of the scene and mesh BVHs: binary, wide (SIMD)
+//                 or compressed (8 bit child bounds) [wide]
+//   --scene S     cornell (Cornell box), mis (glossy floor and spherical
+//                 lights) or bunnies (1024 instances of one bunny) [cornell]
+
+static void usage(const char *program) {
+    std::cerr << "Usage: " << program
+              << " [-MIS|-LIGHT|-BRDF] [--headless] [--spp N] [--batch N]"
+                 " [--threads N] [--time S] [--error E] [--adaptive]"
+                 " [--budget N] [--size WxH] [--depth N] [--rr P]"
+                 " [--bvh naive|sah|sbvh|lbvh|trbvh]"
+                 " [--layout binary|wide|compressed]"
+                 " [--scene cornell|mis|bunnies] [file]\n";
+    std::exit(1);
+}
 
 Scene CreateMISScene(Scene &&scene) {
     auto red = Material::Create(DIFFUSE, Vector3f(0.0f),
@@ -38,11 +81,11 @@ Scene CreateMISScene(Scene &&scene) {
         Material::Create(DIFFUSE, Vector3f(0.14f, 0.45f, 0.091f), Vector3f());
 
     auto floor = std::make_unique<MeshTriangle>(
-        "../models/cornellbox/floor.obj", white.get());
+        "../models/cornellbox/floor.obj", white.get(), scene.bvhLayout);
     auto floor2 = std::make_unique<MeshTriangle>(
-        "../models/cornellbox/floor2.obj", blinn.get());
+        "../models/cornellbox/floor2.obj", blinn.get(), scene.bvhLayout);
     auto wall = std::make_unique<MeshTriangle>(
-        "../models/cornellbox/backwall.obj", blinn.get());
+        "../models/cornellbox/backwall.obj", blinn.get(), scene.bvhLayout);
     auto ball1 =
         std::make_unique<Sphere>(Vector3f{300, 250, 150}, 50, light.get());
     // 绿色光源
@@ -52,11 +95,11 @@ Scene CreateMISScene(Scene &&scene) {
     // Sphere ball3({150,250,150},30,new
     // Material(DIFFUSE,Vector3f(0.63f,0.065f,0.05f)));
     auto bunny = std::make_unique<MeshTriangle>("../models/bunny/bunny2.obj",
-                                                white.get());
+                                                white.get(), scene.bvhLayout);
     auto left = std::make_unique<MeshTriangle>("../models/cornellbox/left.obj",
-                                               red.get());
+                                               red.get(), scene.bvhLayout);
     auto right = std::make_unique<MeshTriangle>(
-        "../models/cornellbox/right.obj", green.get());
+        "../models/cornellbox/right.obj", green.get(), scene.bvhLayout);
 
     scene.Add(std::move(floor));
     scene.Add(std::move(floor2));
@@ -93,21 +136,21 @@ Scene CreateCornellbox(Scene &&scene) {
         Vector3f(0.65f));
 
     auto floor = std::make_unique<MeshTriangle>(
-        "../models/cornellbox/floor.obj", white.get());
+        "../models/cornellbox/floor.obj", white.get(), scene.bvhLayout);
     auto floor2 = std::make_unique<MeshTriangle>(
-        "../models/cornellbox/floor2.obj", white.get());
+        "../models/cornellbox/floor2.obj", white.get(), scene.bvhLayout);
     auto backwall = std::make_unique<MeshTriangle>(
-        "../models/cornellbox/backwall.obj", white.get());
+        "../models/cornellbox/backwall.obj", white.get(), scene.bvhLayout);
     auto shortbox = std::make_unique<MeshTriangle>(
-        "../models/cornellbox/shortbox.obj", white.get());
+        "../models/cornellbox/shortbox.obj", white.get(), scene.bvhLayout);
     auto tallbox = std::make_unique<MeshTriangle>(
-        "../models/cornellbox/tallbox.obj", white.get());
+        "../models/cornellbox/tallbox.obj", white.get(), scene.bvhLayout);
     auto left = std::make_unique<MeshTriangle>("../models/cornellbox/left.obj",
-                                               red.get());
+                                               red.get(), scene.bvhLayout);
     auto right = std::make_unique<MeshTriangle>(
-        "../models/cornellbox/right.obj", green.get());
+        "../models/cornellbox/right.obj", green.get(), scene.bvhLayout);
     auto light_ = std::make_unique<MeshTriangle>(
-        "../models/cornellbox/light.obj", light.get());
+        "../models/cornellbox/light.obj", light.get(), scene.bvhLayout);
 
     scene.Add(std::move(floor));
     scene.Add(std::move(floor2));
@@ -125,29 +168,156 @@ Scene CreateCornellbox(Scene &&scene) {
     return std::move(scene);
 }
 
+// Cornell box filled with a grid of small bunnies. All of them share the
+// triangles and BVH of a single MeshTriangle, each copy is an Instance.
+Scene CreateBunnyField(Scene &&scene) {
+    auto white = Material::Create(DIFFUSE, Vector3f(0.0f),
+                                  Vector3f(0.725f, 0.71f, 0.68f));
+    auto light = Material::Create(
+        DIFFUSE,
+        (8.0f * Vector3f(0.747f + 0.058f, 0.747f + 0.258f, 0.747f) +
+         15.6f * Vector3f(0.740f + 0.287f, 0.740f + 0.160f, 0.740f) +
+         18.4f * Vector3f(0.737f + 0.642f, 0.737f + 0.159f, 0.737f)),
+        Vector3f(0.65f));
+
+    for (const char *name : {"floor", "floor2", "backwall", "left", "right"}) {
+        scene.Add(std::make_unique<MeshTriangle>(
+            std::string("../models/cornellbox/") + name + ".obj",
+            white.get(), scene.bvhLayout));
+    }
+    scene.Add(std::make_unique<MeshTriangle>("../models/cornellbox/light.obj",
+                                             light.get(), scene.bvhLayout));
+
+    std::shared_ptr<const Object> bunny = std::make_shared<MeshTriangle>(
+        "../models/bunny/bunny2.obj", white.get(), scene.bvhLayout);
+    constexpr int kGrid = 32;
+    constexpr float kSpacing = 550.f / kGrid;
+    constexpr float kScale = 0.1f;
+    Bounds3 bounds = bunny->getBounds();
+    Vector3f center = bounds.Centroid();
+    Transform toOrigin =
+        Transform::Scale(kScale) * Transform::Translate(-center);
+    // rest the scaled bunnies on the floor
+    float height = kScale * (center.y - bounds.pMin.y);
+    for (int i = 0; i < kGrid; ++i) {
+        for (int j = 0; j < kGrid; ++j) {
+            Vector3f offset((i + 0.5f) * kSpacing, height,
+                            (j + 0.5f) * kSpacing);
+            float angle = 360.f * (i * kGrid + j) / (kGrid * kGrid);
+            scene.Add(std::make_unique<Instance>(
+                bunny, Transform::Translate(offset) *
+                           Transform::Rotate(angle, Vector3f(0, 1, 0)) *
+                           toOrigin));
+        }
+    }
+
+    scene.Add(std::move(white));
+    scene.Add(std::move(light));
+    return std::move(scene);
+}
+
 int main(int argc, char **argv) {
-    // Change the definition here to change resolution
+    // Change the definition here to change the default resolution
     // Scene scene(784, 784);
     // Scene scene(392,392);
     Scene scene(196, 196);
     std::string filename = "binary.ppm";
-    if (argc > 1) {
-        switch (argv[1][1]) {
-        case 'M':
-            scene.sample = MIS;
-            break;
-        case 'B':
-            scene.sample = BRDF;
-            break;
-        case 'L':
-            scene.sample = LIGHT;
-            break;
-        }
-        if (argc > 2) {
-            filename = argv[2];
+    bool headless = false;
+    RenderOptions options;
+    Scene (*createScene)(Scene &&) = CreateCornellbox;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        // the value of an option that takes one
+        auto value = [&]() -> const char * {
+            if (i + 1 >= argc)
+                usage(argv[0]);
+            return argv[++i];
+        };
+        if (arg == "--headless") {
+            headless = true;
+        } else if (arg == "--spp") {
+            options.spp = std::atoi(value());
+        } else if (arg == "--batch") {
+            options.batchSize = std::atoi(value());
+        } else if (arg == "--threads") {
+            options.threads = std::atoi(value());
+        } else if (arg == "--time") {
+            options.timeBudget = (float)std::atof(value());
+        } else if (arg == "--error") {
+            options.errorThreshold = (float)std::atof(value());
+        } else if (arg == "--adaptive") {
+            options.adaptive = true;
+        } else if (arg == "--budget") {
+            options.sampleBudget = (float)std::atof(value());
+        } else if (arg == "--size") {
+            if (std::sscanf(value(), "%dx%d", &scene.width, &scene.height) !=
+                2)
+                usage(argv[0]);
+        } else if (arg == "--depth") {
+            scene.config.max_depth = std::atoi(value());
+        } else if (arg == "--rr") {
+            scene.config.RussianRoulette = (float)std::atof(value());
+        } else if (arg == "--bvh") {
+            std::string method = value();
+            if (method == "naive")
+                scene.bvhSplit = BVHAccel::SplitMethod::NAIVE;
+            else if (method == "sah")
+                scene.bvhSplit = BVHAccel::SplitMethod::SAH;
+            else if (method == "sbvh")
+                scene.bvhSplit = BVHAccel::SplitMethod::SBVH;
+            else if (method == "lbvh")
+                scene.bvhSplit = BVHAccel::SplitMethod::LBVH;
+            else if (method == "trbvh")
+                scene.bvhSplit = BVHAccel::SplitMethod::TRBVH;
+            else
+                usage(argv[0]);
+        } else if (arg == "--scene") {
+            std::string name = value();
+            if (name == "cornell")
+                createScene = CreateCornellbox;
+            else if (name == "mis")
+                createScene = CreateMISScene;
+            else if (name == "bunnies")
+                createScene = CreateBunnyField;
+            else
+                usage(argv[0]);
+        } else if (arg == "--layout") {
+            std::string layout = value();
+            if (layout == "binary")
+                scene.bvhLayout = BVHAccel::NodeLayout::BINARY;
+            else if (layout == "wide")
+                scene.bvhLayout = BVHAccel::NodeLayout::WIDE;
+            else if (layout == "compressed")
+                scene.bvhLayout = BVHAccel::NodeLayout::COMPRESSED;
+            else
+                usage(argv[0]);
+        } else if (arg.size() > 2 && arg[0] == '-' && arg[1] == '-') {
+            usage(argv[0]);
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            switch (arg[1]) {
+            case 'M':
+                scene.config.sample = MIS;
+                break;
+            case 'B':
+                scene.config.sample = BRDF;
+                break;
+            case 'L':
+                scene.config.sample = LIGHT;
+                break;
+            }
+        } else {
+            filename = arg;
         }
     }
-    switch (scene.sample) {
+    if (options.spp < 1 || options.batchSize < 1 || options.threads < 0 ||
+        options.timeBudget < 0 || options.errorThreshold < 0 ||
+        (options.adaptive && options.errorThreshold <= 0) ||
+        options.sampleBudget < 0 ||
+        scene.width < 1 || scene.height < 1 || scene.config.max_depth < 0 ||
+        !(scene.config.RussianRoulette > 0 &&
+          scene.config.RussianRoulette <= 1))
+        usage(argv[0]);
+    switch (scene.config.sample) {
     case MIS:
         std::cout << "Sample : MIS\n";
         break;
@@ -159,13 +329,21 @@ int main(int argc, char **argv) {
         break;
     }
     std::cout << "Filename: " << filename << "\n";
+    std::cout << "Resolution: " << scene.width << "x" << scene.height << "\n";
 
-    // scene = CreateMISScene(std::move(scene));
-    scene = CreateCornellbox(std::move(scene));
+    scene = createScene(std::move(scene));
     scene.buildBVH();
     scene.initLight();
 
-    Renderer r;
-    r.Render(scene, filename);
+#ifdef RAYTRACING_VIEWER
+    if (!headless) {
+        Viewer viewer(options);
+        viewer.Render(scene, filename);
+        return 0;
+    }
+#endif
+    (void)headless;
+    Renderer r(options);
+    r.RenderToFile(scene, filename);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,156 @@
+// Closest-hit and any-hit queries of the scene BVH against brute force, for
+// each builder, node layout and leaf size.
+
+#include "TestUtil.hpp"
+
+namespace {
+
+using SplitMethod = BVHAccel::SplitMethod;
+using NodeLayout = BVHAccel::NodeLayout;
+
+const std::pair<SplitMethod, const char *> kSplitMethods[] = {
+    {SplitMethod::NAIVE, "naive"},
+    {SplitMethod::SAH, "sah"},
+    {SplitMethod::SBVH, "sbvh"},
+    {SplitMethod::LBVH, "lbvh"},
+    {SplitMethod::TRBVH, "trbvh"},
+};
+
+const std::pair<NodeLayout, const char *> kLayouts[] = {
+    {NodeLayout::BINARY, "binary"},
+    {NodeLayout::WIDE, "wide"},
+    {NodeLayout::COMPRESSED, "compressed"},
+};
+
+void CheckAllBuilders(const char *mesh, const TriangleList &objects,
+                      const std::vector<Ray> &rays) {
+    CHECK(!objects.empty(), "%s: no triangles", mesh);
+    if (objects.empty())
+        return;
+    for (const auto &split : kSplitMethods) {
+        for (const auto &layout : kLayouts) {
+            for (int maxPrims : {1, 4}) {
+                BVHAccel bvh(objects, maxPrims, split.first, layout.first);
+                std::string what = std::string(mesh) + " " + split.second +
+                                   " " + layout.second + " leaf " +
+                                   std::to_string(maxPrims);
+                CheckAgainstBruteForce(what.c_str(), bvh, objects, rays);
+            }
+        }
+    }
+}
+
+void CheckAllBuilders(const char *mesh, const TriangleList &objects,
+                      int numRays) {
+    if (!objects.empty())
+        CheckAllBuilders(mesh, objects, TestRays(objects, numRays));
+    else
+        CHECK(false, "%s: no triangles", mesh);
+}
+
+// A few hundred tiny triangles packed into one Morton cell, plus a far one
+// that stretches the grid: the Morton order builders have to split them by
+// index.
+TriangleList ClusteredTriangles(int count) {
+    TriangleList triangles;
+    Bounds3 cluster(Vector3f(0), Vector3f(1e-4f));
+    for (int i = 0; i < count; ++i) {
+        Vector3f a = UniformIn(cluster);
+        triangles.emplace_back(new Triangle(a, UniformIn(cluster),
+                                            UniformIn(cluster),
+                                            TestMaterial()));
+    }
+    triangles.emplace_back(new Triangle(Vector3f(10, 0, 0),
+                                        Vector3f(10, 1, 0),
+                                        Vector3f(10, 0, 1), TestMaterial()));
+    return triangles;
+}
+
+// Unit triangles facing +x at x = 0, 1, ..., count - 1, and a flattened
+// chain over them: node k has triangle k as its first child and the chain
+// over the remaining ones as its second. Such a tree is deeper than the
+// inline traversal stacks of every layout, and a ray along -x pushes one
+// entry per level.
+TriangleList ChainTriangles(int count) {
+    TriangleList triangles;
+    for (int k = 0; k < count; ++k)
+        triangles.emplace_back(new Triangle(
+            Vector3f((float)k, 0, 0), Vector3f((float)k, 1, 0),
+            Vector3f((float)k, 0, 1), TestMaterial()));
+    return triangles;
+}
+
+std::vector<LinearBVHNode> ChainNodes(const TriangleList &triangles) {
+    int count = (int)triangles.size();
+    std::vector<LinearBVHNode> nodes(2 * count - 1);
+    for (int k = count - 1; k >= 0; --k) {
+        LinearBVHNode &leaf = nodes[2 * k + (k < count - 1)];
+        leaf.bounds = triangles[k]->getBounds();
+        leaf.primitivesOffset = k;
+        leaf.nPrimitives = 1;
+        if (k == count - 1)
+            continue;
+        LinearBVHNode &interior = nodes[2 * k];
+        interior.bounds = Union(leaf.bounds, nodes[2 * k + 2].bounds);
+        interior.secondChildOffset = 2 * k + 2;
+        interior.nPrimitives = 0;
+        interior.axis = 0;
+    }
+    return nodes;
+}
+
+void CheckChain() {
+    const int count = 600;
+    TriangleList objects = ChainTriangles(count);
+    std::vector<Ray> rays = TestRays(objects, 1000);
+    for (int i = 0; i < 500; ++i)
+        rays.emplace_back(Vector3f(count + Uniform(), Uniform(), Uniform()),
+                          Vector3f(-1, 0, 0));
+
+    for (const auto &layout : kLayouts) {
+        BVHAccel bvh(ChainNodes(objects), 1, SplitMethod::SAH, layout.first);
+        CHECK(bvh.maxDepth == count - 1, "chain %s: depth %d", layout.second,
+              bvh.maxDepth);
+        for (size_t i = 0; i < rays.size(); ++i) {
+            const Ray &ray = rays[i];
+            Intersection expected = BruteForceIntersect(objects, ray), actual;
+            float tMax = ray.t_max;
+            bvh.traverse<false>(ray, tMax, [&](int first, int n, float &tMax) {
+                bool found = false;
+                for (int j = first; j < first + n; ++j)
+                    found |= objects[j]->getIntersection(ray, tMax, actual);
+                return found;
+            });
+            CHECK(actual.happened == expected.happened &&
+                      actual.distance == expected.distance,
+                  "chain %s ray %zu: hit %d at %g != %d at %g", layout.second,
+                  i, actual.happened, actual.distance, expected.happened,
+                  expected.distance);
+            tMax = ray.t_max;
+            bool actualP = bvh.traverse<true>(
+                ray, tMax, [&](int first, int n, float &) {
+                    for (int j = first; j < first + n; ++j)
+                        if (objects[j]->IntersectP(ray))
+                            return true;
+                    return false;
+                });
+            CHECK(actualP == BruteForceIntersectP(objects, ray),
+                  "chain %s ray %zu: any-hit %d", layout.second, i, actualP);
+        }
+    }
+}
+
+} // namespace
+
+int main() {
+    CheckAllBuilders("bunny",
+                     LoadTriangles(RAYTRACING_MODELS_DIR "/bunny/bunny.obj"),
+                     2000);
+    CheckAllBuilders("skinny", SkinnyTriangles(2000), 2000);
+    CheckAllBuilders(
+        "tallbox",
+        LoadTriangles(RAYTRACING_MODELS_DIR "/cornellbox/tallbox.obj"), 2000);
+    CheckAllBuilders("clustered", ClusteredTriangles(500), 2000);
+    CheckChain();
+    return TestResult("BVHTest");
+}
@@ -0,0 +1,81 @@
+// Renders the Cornell box with far more samples than the test waits for
+// while another thread reads the published images and then cancels. The
+// pass in flight must return promptly, publish nothing, and every pass
+// after it return at once until Reset starts a new image.
+
+#include <chrono>
+#include <thread>
+
+#include "Renderer.hpp"
+#include "Scene.hpp"
+#include "TestUtil.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// A cancel waits for each worker to finish the pixel it is on, which at a
+// batch of 256 samples takes milliseconds, where the whole pass takes
+// seconds; the rest is slack for loaded machines and sanitizer builds.
+constexpr float kMaxCancelSeconds = 1.f;
+// Time the render gets before the cancel, and to react to one at all.
+constexpr auto kRenderTime = std::chrono::milliseconds(200);
+constexpr auto kGiveUpTime = std::chrono::seconds(30);
+
+float Seconds(Clock::duration duration) {
+    return std::chrono::duration<float>(duration).count();
+}
+
+} // namespace
+
+int main() {
+    TempDir dir("CancelTest");
+    Scene scene(128, 128);
+    CreateCornellbox(scene, dir);
+
+    RenderOptions options;
+    options.spp = 1 << 20;
+    options.batchSize = 256;
+    options.threads = 2;
+    Renderer renderer(options);
+    renderer.Reset(scene);
+    CHECK(renderer.RenderPass(scene), "first pass failed");
+
+    // The reader side as a viewer runs it, until it cancels.
+    Clock::time_point cancelledAt;
+    int framesRead = 0;
+    std::thread canceller([&] {
+        Clock::time_point start = Clock::now();
+        while (Clock::now() - start < kRenderTime) {
+            if (renderer.AcquireFrame())
+                framesRead++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        cancelledAt = Clock::now();
+        renderer.Cancel();
+    });
+    Clock::time_point start = Clock::now();
+    while (renderer.RenderPass(scene) && Clock::now() - start < kGiveUpTime) {
+    }
+    Clock::time_point returnedAt = Clock::now();
+    canceller.join();
+
+    CHECK(framesRead > 0, "no frame was published before the cancel");
+    CHECK(renderer.Cancelled(), "the passes stopped without a cancel");
+    CHECK(Seconds(returnedAt - cancelledAt) < kMaxCancelSeconds,
+          "the pass returned %g s after the cancel",
+          Seconds(returnedAt - cancelledAt));
+    // Drops what the passes before the cancel published.
+    renderer.AcquireFrame();
+    CHECK(!renderer.RenderPass(scene), "a pass ran after the cancel");
+    CHECK(!renderer.AcquireFrame(), "a cancelled pass published a frame");
+    CHECK(!renderer.Finished(), "the cancelled image counts as finished");
+
+    renderer.Reset(scene);
+    CHECK(!renderer.Cancelled(), "Reset kept the cancel");
+    CHECK(renderer.RenderPass(scene), "the pass after Reset failed");
+    CHECK(renderer.AcquireFrame(), "the pass after Reset published nothing");
+    CHECK(renderer.Samples() == 1, "the new image has %g samples, not 1",
+          renderer.Samples());
+    return TestResult("CancelTest");
+}
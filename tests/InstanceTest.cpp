@@ -0,0 +1,233 @@
+// Instances of a mesh against copies of the mesh with the transform baked
+// into the vertices. The two map rays differently, so hits agree to a
+// tolerance relative to the size and position of the geometry, and rays
+// are aimed at face interiors to keep them clear of the edges where either
+// could round into the neighbouring face. Rays that still graze an edge on
+// the way, where either may slip through the crack between two faces, are
+// left out. Areas and light sampling are
+// checked against the baked triangles as well.
+
+#include <algorithm>
+#include <cmath>
+
+#include "Instance.hpp"
+#include "Scene.hpp"
+#include "TestUtil.hpp"
+
+namespace {
+
+constexpr float kTolerance = 1e-4f;
+// barycentric distance from an edge below which hits are left out
+constexpr float kEdgeMargin = 1e-4f;
+
+bool NearEdge(const Intersection &hit) {
+    return hit.happened &&
+           std::min({hit.u, hit.v, 1 - hit.u - hit.v}) < kEdgeMargin;
+}
+
+// Distances and positions carry the rounding of coordinates up to the
+// magnitude of the geometry's bounds, amplified for rays at grazing angles.
+float Slack(const Bounds3 &bounds) {
+    Vector3f magnitude = Vector3f::Max(Vector3f(std::abs(bounds.pMin.x),
+                                                std::abs(bounds.pMin.y),
+                                                std::abs(bounds.pMin.z)),
+                                       Vector3f(std::abs(bounds.pMax.x),
+                                                std::abs(bounds.pMax.y),
+                                                std::abs(bounds.pMax.z)));
+    return kTolerance * (magnitude.norm() + bounds.Diagonal().norm());
+}
+
+// Rays from around the triangles to a point well inside a random face,
+// half of them segments that end before or past it, and random rays that
+// mostly miss.
+std::vector<Ray> InteriorRays(const std::vector<Vector3f> &corners,
+                              int count) {
+    Bounds3 bounds;
+    for (const Vector3f &p : corners)
+        bounds = Union(bounds, p);
+    Vector3f extent = bounds.Diagonal();
+    Bounds3 around(bounds.pMin - extent, bounds.pMax + extent);
+    std::vector<Ray> rays;
+    for (int i = 0; i < count; ++i) {
+        Vector3f origin = UniformIn(around);
+        Vector3f dir(Uniform(-1, 1), Uniform(-1, 1), Uniform(-1, 1));
+        float distance = 0;
+        if (i % 4 != 3) {
+            size_t face = 3 * (TestRng()() % (corners.size() / 3));
+            float a = Uniform(0.2f, 0.6f), b = Uniform(0.2f, 0.8f - a);
+            Vector3f target = corners[face] * (1 - a - b) +
+                              corners[face + 1] * a + corners[face + 2] * b;
+            dir = target - origin;
+            distance = dir.norm();
+        }
+        Ray ray(origin, normalize(dir));
+        if (i % 4 == 1)
+            ray.t_max = distance * 0.9f;
+        else if (i % 4 == 2)
+            ray.t_max = distance * 1.1f;
+        rays.push_back(ray);
+    }
+    return rays;
+}
+
+void CheckSameHits(const char *what, const Object &instance,
+                   const TriangleList &baked, const std::vector<Ray> &rays) {
+    float slack = Slack(instance.getBounds());
+    for (size_t i = 0; i < rays.size(); ++i) {
+        const Ray &ray = rays[i];
+        Intersection actual;
+        float tMax = ray.t_max;
+        bool hit = instance.getIntersection(ray, tMax, actual);
+        Intersection expected = BruteForceIntersect(baked, ray);
+        if (NearEdge(actual) || NearEdge(expected))
+            continue;
+        CHECK(hit == expected.happened, "%s ray %zu: hit %d != %d", what, i,
+              hit, expected.happened);
+        if (hit && expected.happened) {
+            CHECK(std::abs(actual.distance - expected.distance) <= slack,
+                  "%s ray %zu: distance %g != %g", what, i, actual.distance,
+                  expected.distance);
+            instance.getSurfaceProperties(ray, actual);
+            expected.obj->getSurfaceProperties(ray, expected);
+            CHECK(actual.obj == &instance, "%s ray %zu: hit object", what, i);
+            CHECK(dotProduct(actual.normal, expected.normal) > 0.999f,
+                  "%s ray %zu: normals differ", what, i);
+            CHECK((actual.coords - expected.coords).norm() <= slack,
+                  "%s ray %zu: hit points differ", what, i);
+        }
+        CHECK(instance.IntersectP(ray) == BruteForceIntersectP(baked, ray),
+              "%s ray %zu: any-hit differs", what, i);
+    }
+}
+
+// Sample() must be a density over the instance's world space area: the mean
+// of 1 / pdf estimates that area. samplePdf() must report the same pdf for
+// the sampled point, as MIS looks it up for points it hit.
+void CheckSampling(const char *what, const Instance &instance) {
+    constexpr int kSamples = 20000;
+    double inversePdfSum = 0;
+    for (int i = 0; i < kSamples; ++i) {
+        Intersection pos;
+        float pdf = 0;
+        instance.Sample(pos, pdf);
+        inversePdfSum += 1 / pdf;
+        CHECK(std::abs(instance.samplePdf(pos) - pdf) <= 1e-3f * pdf,
+              "%s sample %d: pdf %g != %g", what, i, instance.samplePdf(pos),
+              pdf);
+    }
+    float area = (float)(inversePdfSum / kSamples);
+    CHECK(std::abs(area - instance.getArea()) <= 0.02f * instance.getArea(),
+          "%s: sampled area %g != %g", what, area, instance.getArea());
+}
+
+void CheckInstance(const char *what, const std::shared_ptr<MeshTriangle> &mesh,
+                   const std::vector<Vector3f> &corners,
+                   const Transform &toWorld) {
+    Instance instance(mesh, toWorld);
+    std::vector<Vector3f> world(corners.size());
+    for (size_t i = 0; i < corners.size(); ++i)
+        world[i] = toWorld.Point(corners[i]);
+    TriangleList baked = MakeTriangles(world);
+
+    Bounds3 bakedBounds;
+    float bakedArea = 0;
+    for (const auto &triangle : baked) {
+        bakedBounds = Union(bakedBounds, triangle->getBounds());
+        bakedArea += triangle->getArea();
+    }
+    Bounds3 bounds = instance.getBounds();
+    float slack = Slack(bakedBounds);
+    for (int axis = 0; axis < 3; ++axis)
+        CHECK(bounds.pMin[axis] <= bakedBounds.pMin[axis] + slack &&
+                  bounds.pMax[axis] >= bakedBounds.pMax[axis] - slack,
+              "%s: bounds miss the mesh on axis %d", what, axis);
+    CHECK(std::abs(instance.getArea() - bakedArea) <= 1e-3f * bakedArea,
+          "%s: area %g != %g", what, instance.getArea(), bakedArea);
+
+    CheckSameHits(what, instance, baked, InteriorRays(world, 4000));
+    CheckSampling(what, instance);
+}
+
+// A scene of instances, every other one mirrored, against the same scene
+// of baked triangles, which exercises instances as primitives of the scene
+// BVH.
+void CheckScene(const std::shared_ptr<MeshTriangle> &mesh,
+                const std::vector<Vector3f> &corners) {
+    float extent = mesh->getBounds().Diagonal().norm();
+    Scene instances(1, 1), baked(1, 1);
+    std::vector<Vector3f> allCorners;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            Transform toWorld =
+                Transform::Translate(Vector3f(i, 0, j) * extent) *
+                Transform::Rotate(40.f * (3 * i + j), Vector3f(0, 1, 0)) *
+                Transform::Scale(Vector3f((i + j) % 2 ? -1.f : 1.f, 1, 1) *
+                                 (0.5f + 0.2f * i));
+            instances.Add(std::make_unique<Instance>(mesh, toWorld));
+            for (const Vector3f &p : corners)
+                allCorners.push_back(toWorld.Point(p));
+        }
+    }
+    for (auto &triangle : MakeTriangles(allCorners))
+        baked.Add(std::move(triangle));
+    instances.buildBVH();
+    baked.buildBVH();
+
+    float slack = Slack(instances.bvh->WorldBound());
+    std::vector<Ray> rays = InteriorRays(allCorners, 4000);
+    int grazing = 0;
+    for (size_t i = 0; i < rays.size(); ++i) {
+        Intersection a = instances.intersect(rays[i]);
+        Intersection e = baked.intersect(rays[i]);
+        if (NearEdge(a) || NearEdge(e)) {
+            grazing++;
+            continue;
+        }
+        CHECK(a.happened == e.happened &&
+                  (!a.happened || std::abs(a.distance - e.distance) <= slack),
+              "scene ray %zu: hit %d at %g != %d at %g", i, a.happened,
+              a.distance, e.happened, e.distance);
+    }
+    CHECK(grazing < (int)rays.size() / 100, "%d scene rays graze edges",
+          grazing);
+}
+
+} // namespace
+
+int main() {
+    TempDir dir("InstanceTest");
+    // the bunny at scene scale; Triangle rejects the tiny faces of bunny.obj
+    // once scaled down further
+    std::string model = RAYTRACING_MODELS_DIR "/bunny/bunny2.obj";
+    std::vector<Vector3f> corners = ObjCorners(model);
+    auto mesh = dir.LoadMesh(model);
+    Vector3f center = mesh->getBounds().Centroid();
+
+    CheckInstance("identity", mesh, corners, Transform());
+    // as in the bunny field scene
+    CheckInstance("rigid, scaled", mesh, corners,
+                  Transform::Translate(Vector3f(300, 20, 100)) *
+                      Transform::Rotate(123.f, Vector3f(0, 1, 0)) *
+                      Transform::Scale(0.1f) * Transform::Translate(-center));
+    CheckInstance("non-uniform scale", mesh, corners,
+                  Transform::Translate(Vector3f(1, -2, 3)) *
+                      Transform::Scale(Vector3f(3.f, 0.5f, 1.f)));
+    // non-uniform scale between rotations shears the mesh
+    CheckInstance("sheared", mesh, corners,
+                  Transform::Translate(Vector3f(-5, 2, 7)) *
+                      Transform::Rotate(30.f, Vector3f(1, 1, 0)) *
+                      Transform::Scale(Vector3f(2.f, 0.5f, 1.5f)) *
+                      Transform::Rotate(-50.f, Vector3f(0, 0, 1)));
+    // Mirrors turn the winding of the baked triangles, and with it which
+    // faces are culled and which way the normals point.
+    CheckInstance("mirrored", mesh, corners,
+                  Transform::Translate(Vector3f(4, 0, -1)) *
+                      Transform::Rotate(70.f, Vector3f(0, 1, 1)) *
+                      Transform::Scale(Vector3f(-1.f, 1.f, 1.f)));
+    CheckInstance("mirrored, sheared", mesh, corners,
+                  Transform::Rotate(-20.f, Vector3f(1, 0, 1)) *
+                      Transform::Scale(Vector3f(1.5f, -0.7f, -2.f)) *
+                      Transform::Rotate(45.f, Vector3f(0, 1, 0)));
+    CheckScene(mesh, corners);
+    return TestResult("InstanceTest");
+}
@@ -0,0 +1,48 @@
+// Renders the Cornell box with light sampling and with multiple importance
+// sampling. MIS only reweights the two strategies, so both images must be
+// equally bright on average, within the noise of the estimates.
+
+#include <cmath>
+
+#include "Renderer.hpp"
+#include "Scene.hpp"
+#include "TestUtil.hpp"
+
+namespace {
+
+constexpr int kSize = 32;
+constexpr int kSpp = 256;
+// relative difference of the mean brightness allowed between the images
+constexpr float kTolerance = 0.01f;
+
+// Mean luminance over the image, in linear units.
+float MeanBrightness(Scene &scene, SAMPLE sample) {
+    scene.config.sample = sample;
+    RenderOptions options;
+    options.spp = kSpp;
+    options.batchSize = kSpp;
+    Renderer renderer(options);
+    renderer.Reset(scene);
+    while (!renderer.Finished() && renderer.RenderPass(scene)) {
+    }
+    renderer.AcquireFrame();
+    double sum = 0;
+    for (const Vector3f &color : renderer.Frame())
+        sum += 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+    return (float)(sum / renderer.Frame().size());
+}
+
+} // namespace
+
+int main() {
+    TempDir dir("MISTest");
+    Scene scene(kSize, kSize);
+    CreateCornellbox(scene, dir);
+
+    float light = MeanBrightness(scene, LIGHT);
+    float mis = MeanBrightness(scene, MIS);
+    CHECK(light > 0, "the light sampled image is black");
+    CHECK(std::abs(mis - light) <= kTolerance * light,
+          "MIS image brightness %g != %g with light sampling", mis, light);
+    return TestResult("MISTest");
+}
@@ -0,0 +1,174 @@
+// Deforms a mesh and moves instances of it, refits the BVHs and checks that
+// every ray hits what it hits in the same geometry built from scratch, for
+// the wide layout and for the compressed one, which refit rebuilds.
+
+#include <cmath>
+#include <cstdio>
+#include <functional>
+
+#include "Instance.hpp"
+#include "Scene.hpp"
+#include "TestUtil.hpp"
+
+namespace {
+
+namespace fs = std::filesystem;
+using Deformation = std::function<Vector3f(const Vector3f &)>;
+
+// Writes one face per three corners, with positions that read back exactly.
+void WriteObj(const fs::path &path, const std::vector<Vector3f> &corners) {
+    FILE *file = std::fopen(path.string().c_str(), "w");
+    if (!file)
+        return;
+    for (const Vector3f &p : corners)
+        std::fprintf(file, "v %.9g %.9g %.9g\n", p.x, p.y, p.z);
+    for (size_t i = 0; i + 2 < corners.size(); i += 3)
+        std::fprintf(file, "f %zu %zu %zu\n", i + 1, i + 2, i + 3);
+    std::fclose(file);
+}
+
+std::vector<Bounds3> FaceBounds(const std::vector<Vector3f> &corners) {
+    std::vector<Bounds3> bounds;
+    for (size_t i = 0; i + 2 < corners.size(); i += 3)
+        bounds.push_back(
+            Union(Bounds3(corners[i], corners[i + 1]), corners[i + 2]));
+    return bounds;
+}
+
+// Deforms mesh in place and loads the same deformed mesh from a file of its
+// own, i.e. with a freshly built BVH. corners are the mesh's face corners,
+// deformed on return.
+std::shared_ptr<MeshTriangle> Deform(const fs::path &path,
+                                     std::vector<Vector3f> &corners,
+                                     MeshTriangle &mesh, const Deformation &f) {
+    std::vector<Vector3f> positions(
+        mesh.getVertices(), mesh.getVertices() + mesh.getNumVertices());
+    for (Vector3f &p : positions)
+        p = f(p);
+    mesh.updateVertices(positions);
+
+    for (Vector3f &p : corners)
+        p = f(p);
+    WriteObj(path, corners);
+    return std::make_shared<MeshTriangle>(path.string(), TestMaterial());
+}
+
+void CheckSameHits(const char *what, const Object &actual,
+                   const Object &expected, const std::vector<Ray> &rays) {
+    for (size_t i = 0; i < rays.size(); ++i) {
+        float tActual = rays[i].t_max, tExpected = rays[i].t_max;
+        Intersection a, e;
+        bool hitActual = actual.getIntersection(rays[i], tActual, a);
+        bool hitExpected = expected.getIntersection(rays[i], tExpected, e);
+        CHECK(hitActual == hitExpected && tActual == tExpected,
+              "%s ray %zu: hit %d at %g != %d at %g", what, i, hitActual,
+              tActual, hitExpected, tExpected);
+        CHECK(actual.IntersectP(rays[i]) == expected.IntersectP(rays[i]),
+              "%s ray %zu: any-hit differs", what, i);
+    }
+}
+
+void CheckSameHits(const char *what, const Scene &actual,
+                   const Scene &expected, const std::vector<Ray> &rays) {
+    for (size_t i = 0; i < rays.size(); ++i) {
+        Intersection a = actual.intersect(rays[i]);
+        Intersection e = expected.intersect(rays[i]);
+        CHECK(a.happened == e.happened &&
+                  (!a.happened || a.distance == e.distance),
+              "%s ray %zu: hit %d at %g != %d at %g", what, i, a.happened,
+              a.distance, e.happened, e.distance);
+    }
+}
+
+void CheckMeshRefit(const TempDir &dir, const char *layoutName,
+                    BVHAccel::NodeLayout layout) {
+    std::string model = RAYTRACING_MODELS_DIR "/bunny/bunny.obj";
+    std::vector<Vector3f> corners = ObjCorners(model);
+    auto mesh = std::make_shared<MeshTriangle>(dir.Copy(model), TestMaterial(),
+                                               layout);
+    auto what = [&](const char *check) {
+        return std::string(layoutName) + " " + check;
+    };
+    Bounds3 bounds = mesh->getBounds();
+    Vector3f center = bounds.Centroid();
+    float extent = bounds.Diagonal().norm();
+
+    // Small enough to only refit the node bounds.
+    Deformation wobble = [=](const Vector3f &p) {
+        Vector3f d = (p - center) * (10.f / extent);
+        return p + Vector3f(std::sin(d.y), std::sin(d.z), std::sin(d.x)) *
+                       (0.01f * extent);
+    };
+    auto fresh = Deform(dir.path / "wobbled.obj", corners, *mesh, wobble);
+    CheckSameHits(what("wobbled mesh").c_str(), *mesh, *fresh,
+                  TestRays(FaceBounds(corners), 4000));
+
+    // Tears the mesh in two, so the subtrees spanning the tear degrade
+    // past the rebuild threshold.
+    Deformation tear = [=](const Vector3f &p) {
+        return p.x > center.x ? p + Vector3f(2 * extent, extent, 0) : p;
+    };
+    fresh = Deform(dir.path / "torn.obj", corners, *mesh, tear);
+    CheckSameHits(what("torn mesh").c_str(), *mesh, *fresh,
+                  TestRays(FaceBounds(corners), 4000));
+
+    // Instances of the torn mesh, one of which then moves across the
+    // others, against a scene built from scratch around the fresh mesh.
+    auto placement = [=](int i, float shift) {
+        return Transform::Translate(Vector3f(i * extent + shift, 0, 0)) *
+               Transform::Rotate(40.f * i, Vector3f(0, 1, 0));
+    };
+    const int kInstances = 8;
+    const float kShift = 4.5f * extent;
+    Scene refitScene(1, 1), freshScene(1, 1);
+    refitScene.bvhLayout = layout;
+    for (int i = 0; i < kInstances; ++i) {
+        refitScene.Add(std::make_unique<Instance>(mesh, placement(i, 0)));
+        freshScene.Add(std::make_unique<Instance>(
+            fresh, placement(i, i == 0 ? kShift : 0)));
+    }
+    refitScene.buildBVH();
+    freshScene.buildBVH();
+    static_cast<Instance &>(*refitScene.objects[0])
+        .setTransform(placement(0, kShift));
+    refitScene.refitBVH();
+    std::vector<Bounds3> targets;
+    for (const auto &object : freshScene.objects)
+        targets.push_back(object->getBounds());
+    CheckSameHits(what("moved instance").c_str(), refitScene, freshScene,
+                  TestRays(targets, 4000));
+}
+
+// The bare bounds interface reports whether refit rebuilt anything.
+void CheckRebuildReported() {
+    TriangleList objects = SkinnyTriangles(1000);
+    std::vector<Bounds3> bounds;
+    for (const auto &object : objects)
+        bounds.push_back(object->getBounds());
+    BVHAccel bvh(bounds, 4, BVHAccel::SplitMethod::SAH,
+                 BVHAccel::NodeLayout::BINARY);
+    // refit takes the bounds in leaf order
+    std::vector<Bounds3> ordered(bounds.size());
+    for (size_t i = 0; i < ordered.size(); ++i)
+        ordered[i] = bounds[bvh.primitiveOrder[i]];
+    CHECK(!bvh.refit(ordered), "refit without motion rebuilt subtrees");
+    for (size_t i = 0; i < ordered.size(); i += 2)
+        ordered[i] = Bounds3(ordered[i].pMin + Vector3f(10),
+                             ordered[i].pMax + Vector3f(10));
+    CHECK(bvh.refit(ordered), "refit after tearing rebuilt nothing");
+
+    BVHAccel compressed(bounds, 4, BVHAccel::SplitMethod::SAH,
+                        BVHAccel::NodeLayout::COMPRESSED);
+    CHECK(compressed.refit(bounds), "refit of a compressed tree rebuilt "
+                                    "nothing");
+}
+
+} // namespace
+
+int main() {
+    CheckMeshRefit(TempDir("RefitTest"), "wide", BVHAccel::NodeLayout::WIDE);
+    CheckMeshRefit(TempDir("RefitTest"), "compressed",
+                   BVHAccel::NodeLayout::COMPRESSED);
+    CheckRebuildReported();
+    return TestResult("RefitTest");
+}
@@ -0,0 +1,257 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+// Small helpers shared by the tests: a CHECK macro that counts failures
+// instead of aborting, seeded random geometry and rays, and brute-force
+// reference queries to compare the acceleration structures against.
+
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "BVH.hpp"
+#include "Intersection.hpp"
+#include "Material.hpp"
+#include "OBJ_Loader.hpp"
+#include "Ray.hpp"
+#include "Scene.hpp"
+#include "Triangle.hpp"
+
+static int g_failures = 0;
+
+#define CHECK(cond, ...)                                                       \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            if (++g_failures <= 20) {                                          \
+                std::fprintf(stderr, "%s:%d: CHECK(%s) failed: ", __FILE__,    \
+                             __LINE__, #cond);                                 \
+                std::fprintf(stderr, __VA_ARGS__);                             \
+                std::fprintf(stderr, "\n");                                    \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+inline int TestResult(const char *name) {
+    if (g_failures)
+        std::fprintf(stderr, "%s: %d failures\n", name, g_failures);
+    else
+        std::printf("%s: ok\n", name);
+    return g_failures ? 1 : 0;
+}
+
+inline std::mt19937 &TestRng() {
+    static std::mt19937 rng(20240917u);
+    return rng;
+}
+
+inline float Uniform(float lo = 0, float hi = 1) {
+    return std::uniform_real_distribution<float>(lo, hi)(TestRng());
+}
+
+inline Vector3f UniformIn(const Bounds3 &b) {
+    return Vector3f(Uniform(b.pMin.x, b.pMax.x), Uniform(b.pMin.y, b.pMax.y),
+                    Uniform(b.pMin.z, b.pMax.z));
+}
+
+inline Material *TestMaterial() {
+    static std::unique_ptr<Material> m =
+        Material::Create(DIFFUSE, Vector3f(0), Vector3f(0.5f));
+    return m.get();
+}
+
+using TriangleList = std::vector<std::unique_ptr<Object>>;
+
+// The corners of every face of the single mesh in an OBJ file, in order.
+inline std::vector<Vector3f> ObjCorners(const std::string &filename) {
+    objl::Loader loader;
+    std::vector<Vector3f> corners;
+    if (!loader.LoadFile(filename) || loader.LoadedMeshes.empty())
+        return corners;
+    for (const auto &vertex : loader.LoadedMeshes[0].Vertices)
+        corners.emplace_back(vertex.Position.X, vertex.Position.Y,
+                             vertex.Position.Z);
+    return corners;
+}
+
+// One standalone Triangle per three corners.
+inline TriangleList MakeTriangles(const std::vector<Vector3f> &corners) {
+    TriangleList triangles;
+    for (size_t i = 0; i + 2 < corners.size(); i += 3)
+        triangles.emplace_back(new Triangle(corners[i], corners[i + 1],
+                                            corners[i + 2], TestMaterial()));
+    return triangles;
+}
+
+inline TriangleList LoadTriangles(const std::string &filename) {
+    return MakeTriangles(ObjCorners(filename));
+}
+
+// Scratch directory, removed again on destruction. Meshes are loaded from
+// copies in here so that their BVH caches do not land next to the models.
+class TempDir {
+  public:
+    explicit TempDir(const std::string &name)
+        : path(std::filesystem::temp_directory_path() /
+               (name + "." + std::to_string(TestRng()()))) {
+        std::filesystem::create_directories(path);
+    }
+    ~TempDir() {
+        std::error_code ignored;
+        std::filesystem::remove_all(path, ignored);
+    }
+    TempDir(const TempDir &) = delete;
+    TempDir &operator=(const TempDir &) = delete;
+
+    // Copies model in here and returns the path of the copy.
+    std::string Copy(const std::string &model) const {
+        std::filesystem::path copy =
+            path / std::filesystem::path(model).filename();
+        std::filesystem::copy_file(
+            model, copy, std::filesystem::copy_options::overwrite_existing);
+        return copy.string();
+    }
+
+    // Loads a copy of model as a MeshTriangle.
+    std::shared_ptr<MeshTriangle> LoadMesh(const std::string &model) const {
+        return std::make_shared<MeshTriangle>(Copy(model), TestMaterial());
+    }
+
+    const std::filesystem::path path;
+};
+
+// The Cornell box of the default scene, from copies of its meshes, ready to
+// render.
+inline void CreateCornellbox(Scene &scene, const TempDir &dir) {
+    auto white = Material::Create(DIFFUSE, Vector3f(0.0f),
+                                  Vector3f(0.725f, 0.71f, 0.68f));
+    auto light = Material::Create(DIFFUSE, Vector3f(40.f), Vector3f(0.65f));
+    for (const char *name : {"floor", "floor2", "backwall", "shortbox",
+                             "tallbox", "left", "right"}) {
+        scene.Add(std::make_unique<MeshTriangle>(
+            dir.Copy(RAYTRACING_MODELS_DIR "/cornellbox/" +
+                     std::string(name) + ".obj"),
+            white.get()));
+    }
+    scene.Add(std::make_unique<MeshTriangle>(
+        dir.Copy(RAYTRACING_MODELS_DIR "/cornellbox/light.obj"), light.get()));
+    scene.Add(std::move(white));
+    scene.Add(std::move(light));
+    scene.buildBVH();
+    scene.initLight();
+}
+
+// Long, thin triangles at random orientations inside the unit cube: their
+// bounding boxes overlap heavily, which is what spatial splits are for.
+inline TriangleList SkinnyTriangles(int count) {
+    TriangleList triangles;
+    Bounds3 cube(Vector3f(0), Vector3f(1));
+    for (int i = 0; i < count; ++i) {
+        Vector3f a = UniformIn(cube), b = UniformIn(cube);
+        Vector3f side(Uniform(-0.01f, 0.01f), Uniform(-0.01f, 0.01f),
+                      Uniform(-0.01f, 0.01f));
+        triangles.emplace_back(
+            new Triangle(a, b, a + side, TestMaterial()));
+    }
+    return triangles;
+}
+
+// Rays from around the target boxes: aimed into a random box from nearby
+// and from far away, axis-parallel (zero direction components) and in
+// random directions. Every other ray gets a finite t_max so that the
+// queries also see segments.
+inline std::vector<Ray> TestRays(const std::vector<Bounds3> &targets,
+                                 int count) {
+    Bounds3 scene;
+    for (const Bounds3 &target : targets)
+        scene = Union(scene, target);
+    Vector3f extent = scene.Diagonal();
+    Bounds3 around(scene.pMin - extent, scene.pMax + extent);
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        Vector3f origin = UniformIn(around);
+        Vector3f dir;
+        switch (i % 4) {
+        case 0:
+        case 1: {
+            if (i % 4 == 1)
+                origin = scene.Centroid() + (origin - scene.Centroid()) * 100.f;
+            // half of them at a corner of the target's box, where the slab
+            // tests of the BVH nodes have no slack
+            const Bounds3 &box = targets[TestRng()() % targets.size()];
+            dir = ((i / 8) % 2 ? box.pMax : UniformIn(box)) - origin;
+            break;
+        }
+        case 2: {
+            int axis = (i / 4) % 3;
+            dir = Vector3f(0);
+            dir[axis] = (i / 12) % 2 ? 1.0f : -1.0f;
+            origin = UniformIn(scene);
+            break;
+        }
+        default:
+            dir = Vector3f(Uniform(-1, 1), Uniform(-1, 1), Uniform(-1, 1));
+        }
+        if (dir.norm() == 0)
+            dir = Vector3f(1, 0, 0);
+        Ray ray(origin, normalize(dir));
+        if ((i / 4) % 2)
+            ray.t_max = Uniform(0, 3) * (origin - scene.Centroid()).norm();
+        rays.push_back(ray);
+    }
+    return rays;
+}
+
+inline std::vector<Ray> TestRays(const TriangleList &objects, int count) {
+    std::vector<Bounds3> targets;
+    for (const auto &object : objects)
+        targets.push_back(object->getBounds());
+    return TestRays(targets, count);
+}
+
+inline Intersection BruteForceIntersect(const TriangleList &objects,
+                                        const Ray &ray) {
+    Intersection closest;
+    float tMax = ray.t_max;
+    for (const auto &object : objects) {
+        Intersection isect;
+        if (object->getIntersection(ray, tMax, isect))
+            closest = isect;
+    }
+    return closest;
+}
+
+inline bool BruteForceIntersectP(const TriangleList &objects,
+                                 const Ray &ray) {
+    for (const auto &object : objects) {
+        if (object->IntersectP(ray))
+            return true;
+    }
+    return false;
+}
+
+// Checks closest-hit and any-hit queries of `bvh` against brute force over
+// the same objects, both bounded by the rays' t_max.
+inline void CheckAgainstBruteForce(const char *what, const BVHAccel &bvh,
+                                   const TriangleList &objects,
+                                   const std::vector<Ray> &rays) {
+    for (size_t i = 0; i < rays.size(); ++i) {
+        Intersection expected = BruteForceIntersect(objects, rays[i]);
+        Intersection actual = bvh.Intersect(rays[i]);
+        CHECK(actual.happened == expected.happened, "%s ray %zu: hit %d != %d",
+              what, i, actual.happened, expected.happened);
+        if (actual.happened && expected.happened)
+            CHECK(actual.distance == expected.distance,
+                  "%s ray %zu: distance %g != %g", what, i, actual.distance,
+                  expected.distance);
+        bool expectedP = BruteForceIntersectP(objects, rays[i]);
+        bool actualP = bvh.IntersectP(rays[i]);
+        CHECK(actualP == expectedP, "%s ray %zu: any-hit %d != %d", what, i,
+              actualP, expectedP);
+    }
+}
+
+#endif // TEST_UTIL_H
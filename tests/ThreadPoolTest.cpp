@@ -0,0 +1,71 @@
+// Runs the render loop's pattern on pools of various sizes: jobs draining a
+// TileScheduler, then runs of every count. Every tile must be rendered
+// exactly once, run() must return only after all of its jobs did, and the
+// jobs' plain writes must be visible to the caller afterwards.
+
+#include <atomic>
+
+#include "TestUtil.hpp"
+#include "ThreadPool.hpp"
+#include "TileScheduler.hpp"
+
+namespace {
+
+constexpr int kTiles = 777;
+
+void CheckPool(int numThreads, int repeats) {
+    ThreadPool pool(numThreads);
+    CHECK(pool.size() == numThreads, "pool of %d has %d threads", numThreads,
+          pool.size());
+    for (int repeat = 0; repeat < repeats; ++repeat) {
+        TileScheduler scheduler(kTiles, pool.size());
+        std::vector<std::atomic<int>> rendered(kTiles);
+        // written by the jobs without synchronization of their own
+        std::vector<int> owner(kTiles, -1);
+        pool.run(pool.size(), [&](int worker) {
+            for (int tile; (tile = scheduler.next(worker)) >= 0;) {
+                rendered[tile]++;
+                owner[tile] = worker;
+            }
+        });
+        for (int tile = 0; tile < kTiles; ++tile) {
+            CHECK(rendered[tile] == 1, "pool of %d, run %d: tile %d rendered "
+                  "%d times", numThreads, repeat, tile, rendered[tile].load());
+            CHECK(owner[tile] >= 0 && owner[tile] < pool.size(),
+                  "pool of %d, run %d: tile %d owned by %d", numThreads,
+                  repeat, tile, owner[tile]);
+        }
+
+        int count = repeat % 50;
+        std::vector<std::atomic<int>> calls(count);
+        std::atomic<int> finished{0};
+        pool.run(count, [&](int i) {
+            calls[i]++;
+            finished++;
+        });
+        CHECK(finished == count, "pool of %d: run(%d) returned after %d jobs",
+              numThreads, count, finished.load());
+        for (int i = 0; i < count; ++i)
+            CHECK(calls[i] == 1, "pool of %d: run(%d) called job %d %d times",
+                  numThreads, count, i, calls[i].load());
+    }
+}
+
+// The destructor finishes the jobs queued before it.
+void CheckShutdown() {
+    std::atomic<int> finished{0};
+    {
+        ThreadPool pool(4);
+        pool.run(100, [&](int) { finished++; });
+    }
+    CHECK(finished == 100, "pool finished %d of 100 jobs", finished.load());
+}
+
+} // namespace
+
+int main() {
+    for (int numThreads : {1, 3, 8, 32})
+        CheckPool(numThreads, 200);
+    CheckShutdown();
+    return TestResult("ThreadPoolTest");
+}
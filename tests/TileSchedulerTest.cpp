@@ -0,0 +1,56 @@
+// Workers drain TileSchedulers of various sizes concurrently, with the
+// first quarter of the tiles expensive so that the others steal. Every tile
+// must be handed out exactly once, and a drained scheduler stays drained.
+
+#include <atomic>
+#include <thread>
+
+#include "TestUtil.hpp"
+#include "TileScheduler.hpp"
+
+namespace {
+
+void Drain(int numTiles, int numWorkers) {
+    TileScheduler scheduler(numTiles, numWorkers);
+    std::vector<std::atomic<int>> handedOut(numTiles);
+    std::atomic<int> lateTiles{0};
+    std::vector<std::thread> workers;
+    for (int w = 0; w < numWorkers; ++w) {
+        workers.emplace_back([&, w] {
+            for (int tile; (tile = scheduler.next(w)) >= 0;) {
+                if (tile >= numTiles) {
+                    lateTiles++;
+                    continue;
+                }
+                handedOut[tile]++;
+                volatile int work = 0;
+                for (int i = 0; i < (tile < numTiles / 4 ? 2000 : 10); ++i)
+                    work = work + i;
+            }
+            // once empty, always empty
+            if (scheduler.next(w) >= 0)
+                lateTiles++;
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+
+    CHECK(lateTiles == 0, "%d tiles, %d workers: %d bad tiles", numTiles,
+          numWorkers, lateTiles.load());
+    for (int tile = 0; tile < numTiles; ++tile)
+        CHECK(handedOut[tile] == 1, "%d tiles, %d workers: tile %d handed "
+              "out %d times", numTiles, numWorkers, tile,
+              handedOut[tile].load());
+}
+
+} // namespace
+
+int main() {
+    for (int numWorkers : {1, 2, 3, 7, 16, 64}) {
+        for (int numTiles : {0, 1, 5, 100, 1000, 10000}) {
+            for (int repeat = 0; repeat < 3; ++repeat)
+                Drain(numTiles, numWorkers);
+        }
+    }
+    return TestResult("TileSchedulerTest");
+}
@@ -0,0 +1,66 @@
+// Renders the Cornell box under a time budget with passes that take far
+// longer than the budget. The pass in flight must stop sampling when the
+// budget runs out, so the image finishes shortly after it, and still
+// publish a whole image.
+
+#include <chrono>
+#include <cmath>
+
+#include "Renderer.hpp"
+#include "Scene.hpp"
+#include "TestUtil.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr float kTimeBudget = 0.5f;
+// Past the budget a worker finishes the pixel it is on, at a batch of 256
+// samples milliseconds, where a whole pass takes seconds; the rest is
+// slack for the first pass, which always completes, on loaded machines and
+// sanitizer builds.
+constexpr float kMaxOvershootSeconds = 1.f;
+constexpr auto kGiveUpTime = std::chrono::seconds(30);
+
+} // namespace
+
+int main() {
+    TempDir dir("TimeBudgetTest");
+    Scene scene(128, 128);
+    CreateCornellbox(scene, dir);
+
+    RenderOptions options;
+    options.spp = 1 << 20;
+    options.batchSize = 256;
+    options.threads = 2;
+    options.timeBudget = kTimeBudget;
+    Renderer renderer(options);
+
+    Clock::time_point start = Clock::now();
+    renderer.Reset(scene);
+    while (!renderer.Finished() && renderer.RenderPass(scene) &&
+           Clock::now() - start < kGiveUpTime) {
+    }
+    float seconds = std::chrono::duration<float>(Clock::now() - start).count();
+
+    CHECK(renderer.Finished(), "the image is not finished after %g s",
+          seconds);
+    CHECK(seconds - kTimeBudget < kMaxOvershootSeconds,
+          "a budget of %g s took %g s", kTimeBudget, seconds);
+    CHECK(renderer.Samples() >= 1, "the image has %g samples per pixel",
+          renderer.Samples());
+
+    CHECK(renderer.AcquireFrame(), "no image was published");
+    float brightness = 0;
+    int broken = 0;
+    for (const Vector3f &color : renderer.Frame()) {
+        if (!std::isfinite(color.x + color.y + color.z) || color.x < 0 ||
+            color.y < 0 || color.z < 0)
+            broken++;
+        else
+            brightness += color.x + color.y + color.z;
+    }
+    CHECK(broken == 0, "%d pixels of the image are broken", broken);
+    CHECK(brightness > 0, "the image is black");
+    return TestResult("TimeBudgetTest");
+}
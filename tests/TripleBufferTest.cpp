@@ -0,0 +1,63 @@
+// A writer publishes numbered frames as fast as it can while a reader
+// acquires them. Every frame the reader sees must be complete, i.e. carry
+// a single frame number throughout, frames must arrive in order, and the
+// last one published must be the last one read.
+
+#include <atomic>
+#include <thread>
+
+#include "TestUtil.hpp"
+#include "TripleBuffer.hpp"
+
+namespace {
+
+using Frame = std::vector<int>;
+
+constexpr int kFrames = 50000;
+constexpr int kFrameSize = 1000;
+
+// Returns the frame number of frame, or -2 if it mixes several.
+int FrameNumber(const Frame &frame) {
+    for (int value : frame) {
+        if (value != frame.front())
+            return -2;
+    }
+    return frame.front();
+}
+
+} // namespace
+
+int main() {
+    TripleBuffer<Frame> buffer;
+    buffer.reset(Frame(kFrameSize, -1));
+    CHECK(!buffer.acquire(), "acquired a frame before any was published");
+
+    std::atomic<bool> writing{true};
+    std::thread writer([&] {
+        for (int i = 0; i < kFrames; ++i) {
+            Frame &frame = buffer.back();
+            for (int &value : frame)
+                value = i;
+            buffer.publish();
+        }
+        writing = false;
+    });
+    int last = -1;
+    auto read = [&] {
+        if (!buffer.acquire())
+            return;
+        int number = FrameNumber(buffer.front());
+        CHECK(number >= 0, "frame after %d is torn", last);
+        CHECK(number > last, "frame %d arrived after frame %d", number, last);
+        last = number;
+    };
+    while (writing)
+        read();
+    writer.join();
+    read();
+
+    CHECK(last == kFrames - 1, "last frame read is %d, not %d", last,
+          kFrames - 1);
+    CHECK(!buffer.acquire(), "acquired a frame twice");
+    return TestResult("TripleBufferTest");
+}